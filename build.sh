@@ -6,4 +6,26 @@ g++ -std=c++11 -c ../source/*.cpp -O2 -DNDEBUG
 g++ -o nmegtbdemo *.o
 rm *.o
 cd ..
+
+# bash build.sh test: build the programs of folder tests (with statistics) and run them,
+# each one with the endgames and a copy of them it could change
+if [ "$1" = "test" ]; then
+    mkdir -p exect/tests
+    cd exect/tests
+    rm -rf *
+    gcc -std=c99 -c ../../source/lzma/*.c
+    g++ -std=c++11 -c ../../source/Egtb*.cpp -O2 -DEGTB_CACHE_STATS -DEGTB_DECOMPRESS_STATS
+    failed=0
+    for test in ../../tests/*Test.cpp; do
+        name=$(basename $test .cpp)
+        rm -rf work && cp -r ../../egtb work
+        if ! g++ -std=c++11 -O2 -DEGTB_CACHE_STATS -DEGTB_DECOMPRESS_STATS -I../../source -o $name $test *.o -lpthread || ! ./$name ../../egtb work; then
+            failed=1
+        fi
+    done
+    rm -rf work *.o
+    cd ../..
+    exit $failed
+fi
+
 ./exect/nmegtbdemo
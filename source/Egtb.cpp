@@ -27,17 +27,26 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
 
 // for scaning files from a given path
 #ifdef _WIN32
 
 #include <windows.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #else
 
 #include <glob.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <cerrno>
 #include <fstream>
 
 #endif
@@ -92,16 +101,19 @@ namespace egtb {
 
 
 #ifdef _WIN32
-    static void findFiles(std::vector<std::string>& names, const std::string& dirname) {
+    static void findFiles(std::vector<std::string>& names, const std::string& dirname, std::vector<std::string>* dirs) {
         std::string search_path = dirname + "/*.*";
 
         WIN32_FIND_DATA file;
         HANDLE search_handle = FindFirstFile(search_path.c_str(), &file);
         if (search_handle) {
+            if (dirs) {
+                dirs->push_back(dirname);
+            }
             do {
                 std::string fullpath = dirname + "/" + file.cFileName;
                 if ((file.dwFileAttributes | FILE_ATTRIBUTE_DIRECTORY) == FILE_ATTRIBUTE_DIRECTORY && (file.cFileName[0] != '.')) {
-                    findFiles(names, fullpath);
+                    findFiles(names, fullpath, dirs);
                 } else {
                     names.push_back(fullpath);
                 }
@@ -110,15 +122,15 @@ namespace egtb {
         }
     }
 
-    std::vector<std::string> listdir(std::string dirname) {
+    std::vector<std::string> listdir(std::string dirname, std::vector<std::string>* dirs) {
         std::vector<std::string> names;
-        findFiles(names, dirname);
+        findFiles(names, dirname, dirs);
         return names;
     }
 
 #else
 
-    std::vector<std::string> listdir(std::string dirname) {
+    std::vector<std::string> listdir(std::string dirname, std::vector<std::string>* dirs) {
         DIR* d_fh;
         struct dirent* entry;
 
@@ -128,6 +140,10 @@ namespace egtb {
             return vec;
         }
 
+        if (dirs) {
+            dirs->push_back(dirname);
+        }
+
         dirname += "/";
 
         while ((entry=readdir(d_fh)) != NULL) {
@@ -138,7 +154,7 @@ namespace egtb {
 
                 // If it's a directory print it's name and recurse into it
                 if (entry->d_type == DT_DIR) {
-                    auto vec2 = listdir(dirname + entry->d_name);
+                    auto vec2 = listdir(dirname + entry->d_name, dirs);
                     vec.insert(vec.end(), vec2.begin(), vec2.end());
                 }
                 else {
@@ -152,6 +168,141 @@ namespace egtb {
         return vec;
     }
 
+#endif
+
+#ifdef _WIN32
+    const EgtbFileHandle EGTB_INVALID_FILE = INVALID_HANDLE_VALUE;
+
+    EgtbFileHandle openFileForRead(const std::string& path) {
+        return CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+    }
+
+    void closeFile(EgtbFileHandle handle) {
+        if (handle != EGTB_INVALID_FILE) {
+            CloseHandle(handle);
+        }
+    }
+
+    bool getFileStat(const std::string& path, i64& sz, i64& mtime) {
+        struct _stat64 st;
+        if (_stat64(path.c_str(), &st) != 0) {
+            return false;
+        }
+        sz = st.st_size;
+        mtime = st.st_mtime;
+        return true;
+    }
+
+    bool readFileAt(EgtbFileHandle handle, char* buf, i64 sz, i64 offset) {
+        while (sz > 0) {
+            OVERLAPPED overlapped;
+            memset(&overlapped, 0, sizeof(overlapped));
+            overlapped.Offset = (DWORD)offset;
+            overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+            DWORD n = 0;
+            if (!ReadFile(handle, buf, (DWORD)MIN(sz, (i64)(1 << 30)), &n, &overlapped) || n == 0) {
+                return false;
+            }
+            buf += n; sz -= n; offset += n;
+        }
+        return true;
+    }
+
+    const char* mapFile(const std::string& path, i64& sz) {
+        sz = 0;
+        auto handle = openFileForRead(path);
+        if (handle == EGTB_INVALID_FILE) {
+            return nullptr;
+        }
+
+        const char* data = nullptr;
+        LARGE_INTEGER fileSize;
+        if (GetFileSizeEx(handle, &fileSize) && fileSize.QuadPart > 0) {
+            auto mapping = CreateFileMapping(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (mapping) {
+                data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                CloseHandle(mapping);
+                if (data) {
+                    sz = fileSize.QuadPart;
+                }
+            }
+        }
+        closeFile(handle);
+        return data;
+    }
+
+    void unmapFile(const char* data, i64 sz) {
+        if (data) {
+            UnmapViewOfFile(data);
+        }
+    }
+
+#else
+    const EgtbFileHandle EGTB_INVALID_FILE = -1;
+
+    EgtbFileHandle openFileForRead(const std::string& path) {
+        return open(path.c_str(), O_RDONLY);
+    }
+
+    void closeFile(EgtbFileHandle handle) {
+        if (handle != EGTB_INVALID_FILE) {
+            close(handle);
+        }
+    }
+
+    bool getFileStat(const std::string& path, i64& sz, i64& mtime) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) {
+            return false;
+        }
+        sz = st.st_size;
+        mtime = st.st_mtime;
+        return true;
+    }
+
+    bool readFileAt(EgtbFileHandle handle, char* buf, i64 sz, i64 offset) {
+        while (sz > 0) {
+            auto n = pread(handle, buf, (size_t)sz, (off_t)offset);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            buf += n; sz -= n; offset += n;
+        }
+        return true;
+    }
+
+    const char* mapFile(const std::string& path, i64& sz) {
+        sz = 0;
+        auto handle = openFileForRead(path);
+        if (handle == EGTB_INVALID_FILE) {
+            return nullptr;
+        }
+
+        const char* data = nullptr;
+        struct stat st;
+        if (fstat(handle, &st) == 0 && st.st_size > 0) {
+            auto p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, handle, 0);
+            if (p != MAP_FAILED) {
+                // probes jump around, read-ahead is mostly wasted
+                madvise(p, (size_t)st.st_size, MADV_RANDOM);
+                data = (const char*)p;
+                sz = st.st_size;
+            }
+        }
+        closeFile(handle);
+        return data;
+    }
+
+    void unmapFile(const char* data, i64 sz) {
+        if (data) {
+            munmap((void*)data, (size_t)sz);
+        }
+    }
+
 #endif
 
     static void * _allocForLzma(ISzAllocPtr, size_t size) { return malloc(size); }
@@ -160,42 +311,243 @@ namespace egtb {
 
     static const Byte lzmaPropData[5] = { 93, 0, 0, 0, 1 };
 
+    // One decoder for each thread. Its probabilities are allocated once, blocks are decoded straight into
+    // destinations (as dictionaries, all blocks are smaller than the dictionary size), thus no allocation when decoding
+    class EgtbLzmaDecoder {
+    public:
+        EgtbLzmaDecoder() {
+            LzmaDec_Construct(&dec);
+            ready = LzmaDec_AllocateProbs(&dec, lzmaPropData, LZMA_PROPS_SIZE, &_szAllocForLzma) == SZ_OK;
+        }
+
+        ~EgtbLzmaDecoder() {
+            LzmaDec_FreeProbs(&dec, &_szAllocForLzma);
+        }
+
+        CLzmaDec    dec;
+        bool        ready;
+    };
+
+    static thread_local EgtbLzmaDecoder lzmaDecoder;
+
+#ifdef EGTB_DECOMPRESS_STATS
+    static std::atomic<i64> decompressCnt(0), decompressTime(0);
+
+    void getDecompressStats(i64& cnt, i64& nanoseconds) {
+        cnt = decompressCnt;
+        nanoseconds = decompressTime;
+    }
+
+    void resetDecompressStats() {
+        decompressCnt = 0;
+        decompressTime = 0;
+    }
+#else
+    void getDecompressStats(i64& cnt, i64& nanoseconds) {
+        cnt = nanoseconds = 0;
+    }
+
+    void resetDecompressStats() {
+    }
+#endif
+
     int decompress(char *dst, int uncompresslen, const char *src, int slen) {
-        SizeT srcLen = slen, dstLen = uncompresslen;
+        auto& decoder = lzmaDecoder;
+        if (!decoder.ready || slen < 5) {  // 5: init size of the range coder
+            return -1;
+        }
+
+#ifdef EGTB_DECOMPRESS_STATS
+        auto startTime = std::chrono::steady_clock::now();
+#endif
+
+        decoder.dec.dic = (Byte *)dst;
+        decoder.dec.dicBufSize = uncompresslen;
+        LzmaDec_Init(&decoder.dec);
+
+        SizeT srcLen = slen;
         ELzmaStatus lzmaStatus;
+        SRes res = LzmaDec_DecodeToDic(&decoder.dec, uncompresslen, (const Byte *)src, &srcLen, LZMA_FINISH_ANY, &lzmaStatus);
+        if (res == SZ_OK && lzmaStatus == LZMA_STATUS_NEEDS_MORE_INPUT) {
+            res = SZ_ERROR_INPUT_EOF;
+        }
+
+        auto dstLen = decoder.dec.dicPos;
+        decoder.dec.dic = nullptr;
+
+#ifdef EGTB_DECOMPRESS_STATS
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+        decompressCnt.fetch_add(1, std::memory_order_relaxed);
+        decompressTime.fetch_add((i64)elapsed, std::memory_order_relaxed);
+#endif
 
-        SRes res = LzmaDecode(
-                              (Byte *)dst, &dstLen,
-                              (const Byte *)src, &srcLen,
-                              lzmaPropData, LZMA_PROPS_SIZE,
-                              LZMA_FINISH_ANY,
-                              &lzmaStatus, &_szAllocForLzma
-                              );
         return res == SZ_OK ? (int)dstLen : -1;
     }
 
-    i64 decompressAllBlocks(int blocksize, int blocknum, u32* blocktable, char *dest, i64 uncompressedlen, const char *src, i64 slen) {
-        auto *s = src;
-        auto p = dest;
+    EgtbDecodeStream::EgtbDecodeStream() {
+        key = 0;
+        srcLen = srcPos = dstLen = decodedSz = 0;
+        memset(droppedKeys, 0, sizeof(droppedKeys));
+        droppedIdx = 0;
+        src = (char*)malloc(EGTB_SIZE_COMPRESS_BLOCK_MAX * 3 / 2);
+        dst = (char*)malloc(EGTB_SIZE_COMPRESS_BLOCK_MAX);
+
+        auto p = new CLzmaDec;
+        LzmaDec_Construct(p);
+        if (LzmaDec_AllocateProbs(p, lzmaPropData, LZMA_PROPS_SIZE, &_szAllocForLzma) != SZ_OK) {
+            delete p;
+            p = nullptr;
+        }
+        dec = p;
+    }
+
+    EgtbDecodeStream::~EgtbDecodeStream() {
+        auto p = (CLzmaDec*)dec;
+        if (p) {
+            LzmaDec_FreeProbs(p, &_szAllocForLzma);
+            delete p;
+        }
+        free(src);
+        free(dst);
+    }
+
+    void EgtbDecodeStream::begin(u64 _key, int _srcLen, int _dstLen) {
+        assert(_srcLen <= EGTB_SIZE_COMPRESS_BLOCK_MAX * 3 / 2 && _dstLen <= EGTB_SIZE_COMPRESS_BLOCK_MAX);
+        key = _key;
+        srcLen = _srcLen;
+        dstLen = _dstLen;
+        srcPos = decodedSz = 0;
+
+        auto p = (CLzmaDec*)dec;
+        if (p) {
+            p->dic = (Byte *)dst;
+            p->dicBufSize = dstLen;
+            LzmaDec_Init(p);
+        }
+    }
+
+    void EgtbDecodeStream::drop() {
+        if (key != 0) {
+            droppedKeys[droppedIdx] = key;
+            droppedIdx = (droppedIdx + 1) % EGTB_DECODE_DROPPED_KEYS;
+            key = 0;
+        }
+    }
+
+    bool EgtbDecodeStream::isDropped(u64 _key) const {
+        for(int i = 0; i < EGTB_DECODE_DROPPED_KEYS; i++) {
+            if (droppedKeys[i] == _key) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Continue decoding until having at least need bytes, return false if failed
+    bool EgtbDecodeStream::decodeTo(int need) {
+        auto p = (CLzmaDec*)dec;
+        if (p == nullptr || key == 0) {
+            return false;
+        }
+
+        need = MIN(need, dstLen);
+        if (decodedSz >= need) {
+            return true;
+        }
+
+#ifdef EGTB_DECOMPRESS_STATS
+        auto startTime = std::chrono::steady_clock::now();
+#endif
+
+        SizeT inLen = srcLen - srcPos;
+        ELzmaStatus lzmaStatus;
+        SRes res = LzmaDec_DecodeToDic(p, need, (const Byte *)src + srcPos, &inLen, LZMA_FINISH_ANY, &lzmaStatus);
+        srcPos += (int)inLen;
+        decodedSz = (int)p->dicPos;
+
+#ifdef EGTB_DECOMPRESS_STATS
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+        decompressTime.fetch_add((i64)elapsed, std::memory_order_relaxed);
+        if (decodedSz == dstLen) {
+            decompressCnt.fetch_add(1, std::memory_order_relaxed);
+        }
+#endif
+
+        return res == SZ_OK && decodedSz >= need;
+    }
+
+    // Decompress blocks from beginIdx to endIdx - 1, each block is written at its own offset in dest
+    static bool decompressBlocks(i64 beginIdx, i64 endIdx, int blocksize, const EgtbBlockTable& blocktable, char *dest, i64 uncompressedlen, const char *src, i64 slen) {
+        for(i64 i = beginIdx; i < endIdx; i++) {
+            i64 blockOffset, blocksz;
+            bool iscompressed;
+            blocktable.getBlock(i, blockOffset, blocksz, iscompressed);
 
-        for(int i = 0; i < blocknum; i++) {
-            int blocksz = (blocktable[i] & ~EGTB_UNCOMPRESS_BIT) - (i == 0 ? 0 : (blocktable[i - 1] & ~EGTB_UNCOMPRESS_BIT));
-            int uncompressed = blocktable[i] & EGTB_UNCOMPRESS_BIT;
+            auto p = dest + i * blocksize;
+            auto curBlockSize = (int)MIN(uncompressedlen - i * blocksize, (i64)blocksize);
 
-            if (uncompressed) {
-                memcpy(p, s, blocksz);
-                p += blocksz;
-            } else {
-                auto left = uncompressedlen - (i64)(p - dest);
-                auto curBlockSize = (int)MIN(left, (i64)blocksize);
+            if (blocksz < 0 || blocksz > blocksize * 3 / 2 || blockOffset + blocksz > slen) {
+                return false;
+            }
 
-                auto originSz = decompress((char*)p, curBlockSize, s, blocksz);
-                p += originSz;
+            if (!iscompressed) {
+                if (blocksz != curBlockSize) {
+                    return false;
+                }
+                memcpy(p, src + blockOffset, blocksz);
+            } else if (decompress(p, curBlockSize, src + blockOffset, (int)blocksz) != curBlockSize) {
+                return false;
             }
-            s += blocksz;
+        }
+        return true;
+    }
+
+    // Threads decompressing now, of all callers (the callers are counted too). Helper threads are started
+    // only while that number is under the limit, thus parallel loadings don't start threads by dozens
+    static std::atomic<int> decompressingThreadCnt(0);
+
+    // Blocks are independent, they are decompressed by several threads, each takes a range of blocks.
+    // Return the uncompressed size or -1 if failed
+    i64 decompressAllBlocks(int blocksize, const EgtbBlockTable& blocktable, char *dest, i64 uncompressedlen, const char *src, i64 slen) {
+        auto blocknum = blocktable.getBlockCount();
+        int threadLimit = (int)MIN((unsigned)std::thread::hardware_concurrency(), (unsigned)EGTB_DECOMPRESS_MAX_THREADS);
+        int threadCnt = (int)MIN((i64)threadLimit, blocknum / EGTB_DECOMPRESS_MIN_BLOCKS_PER_THREAD);
+
+        // reserve helpers from the shared budget
+        int cur = ++decompressingThreadCnt;
+        int helperCnt = 0;
+        while (threadCnt > 1 && cur < threadLimit) {
+            int n = MIN(threadCnt - 1, threadLimit - cur);
+            if (decompressingThreadCnt.compare_exchange_weak(cur, cur + n)) {
+                helperCnt = n;
+                break;
+            }
+        }
+        threadCnt = helperCnt + 1;
+
+        std::atomic<bool> ok(true);
+        std::vector<std::thread> threads;
+        for(int t = 1; t < threadCnt; t++) {
+            i64 beginIdx = blocknum * t / threadCnt;
+            i64 endIdx = blocknum * (t + 1) / threadCnt;
+            threads.push_back(std::thread([=, &blocktable, &ok]() {
+                if (!decompressBlocks(beginIdx, endIdx, blocksize, blocktable, dest, uncompressedlen, src, slen)) {
+                    ok = false;
+                }
+            }));
+        }
+
+        // the caller takes the first range
+        if (!decompressBlocks(0, blocknum / threadCnt, blocksize, blocktable, dest, uncompressedlen, src, slen)) {
+            ok = false;
+        }
+
+        for (auto && t : threads) {
+            t.join();
         }
 
-        return (i64)(p - dest);
+        decompressingThreadCnt -= threadCnt;
+        return ok ? uncompressedlen : -1;
     }
 }
 
@@ -28,6 +28,7 @@
 
 #include <iostream>
 #include <sstream>
+#include <cstring>
 #include <cstdarg>
 #include <algorithm>
 #include <vector>
@@ -89,6 +90,11 @@ namespace egtb {
 #define EGTB_SCORE_MISSING      1006
 #define EGTB_SCORE_UNSET        1007
 
+// results of WDL probes, for the side to move
+#define EGTB_WDL_LOSS           (-1)
+#define EGTB_WDL_DRAW           0
+#define EGTB_WDL_WIN            1
+
 
     ////////////////////////////////////
 #define EGTB_SIZE_K2            32
@@ -110,13 +116,28 @@ namespace egtb {
 
 
 #define EGTB_ID_MAIN_V0                 23456
-
-#define EGTB_SIZE_COMPRESS_BLOCK        (4 * 1024)
+#define EGTB_ID_MAIN_V1                 23457   // V0 + size of compress blocks
+#define EGTB_ID_MAIN_V2                 23458   // V1 + 64-bit block tables
+
+#define EGTB_SIZE_COMPRESS_BLOCK        (4 * 1024)  // V0 files
+#define EGTB_SIZE_COMPRESS_BLOCK_MIN_SHIFT  10      // V1 files: from 1 KB
+#define EGTB_SIZE_COMPRESS_BLOCK_MAX_SHIFT  16      // to 64 KB
+#define EGTB_SIZE_COMPRESS_BLOCK_MAX    (1 << EGTB_SIZE_COMPRESS_BLOCK_MAX_SHIFT)
+
+// larger blocks are kept in the block cache as pages of that size
+#define EGTB_SIZE_CACHE_PAGE            (4 * 1024)
+// partly decoded blocks given up recently, remembered by each thread
+#define EGTB_DECODE_DROPPED_KEYS        8
 #define EGTB_PROP_COMPRESSED            (1 << 2)
 #define EGTB_PROP_SPECIAL_SCORE_RANGE   (1 << 3)
+#define EGTB_PROP_WDL                   (1 << 4)    // WDL companion files, 2 bits a cell
 
 #define EGTB_HEADER_SIZE                128
 
+// loading compressed data in memory mode all: blocks are decompressed by up to that many threads, shared by all loadings
+#define EGTB_DECOMPRESS_MAX_THREADS             16
+#define EGTB_DECOMPRESS_MIN_BLOCKS_PER_THREAD   64
+
 #define DARK                            8
 #define LIGHT                           16
 
@@ -124,8 +145,10 @@ namespace egtb {
 #define W                               1
 
 #define EGTB_SMART_MODE_THRESHOLD       10L * 1024 * 1024L
+#define EGTB_BLOCK_CACHE_SIZE           (8L * 1024 * 1024L)
 
     const int EGTB_UNCOMPRESS_BIT       = 1 << 31;
+    const uint64_t EGTB_UNCOMPRESS_BIT64 = 1ULL << 63;  // V2 block tables
 
     enum class Side {
         black = 0, white = 1, none = 2, offboard = 3
@@ -190,7 +213,10 @@ namespace egtb {
     enum EgtbMemMode {
         tiny,          // load minimum to memory
         all,            // load all data into memory, no access hard disk after loading
-        smart           // depend on data size, load as small or all mode
+        smart,          // depend on data size, load as small or all mode
+        mapped,         // map files into memory, data is shared via the page cache of OS
+        compressed,     // load compressed data into memory, blocks are decompressed when needed, no access hard disk after loading
+        packed          // as all, then cells are packed by fewer bits in memory
     };
 
     enum EgtbLoadMode {
@@ -207,10 +233,62 @@ namespace egtb {
     std::string posToCoordinateString(int pos);
     std::string getFileName(const std::string& path);
     std::string getVersion();
-    std::vector<std::string> listdir(std::string dirname);
+    // All files of a folder and its subfolders. Those folders are put in dirs (if any) too
+    std::vector<std::string> listdir(std::string dirname, std::vector<std::string>* dirs = nullptr);
+
+    // Files kept open for positional reads, safe to be used by many threads at the same time
+#ifdef _WIN32
+    typedef void* EgtbFileHandle;
+#else
+    typedef int EgtbFileHandle;
+#endif
+    extern const EgtbFileHandle EGTB_INVALID_FILE;
+
+    EgtbFileHandle openFileForRead(const std::string& path);
+    void closeFile(EgtbFileHandle handle);
+    bool readFileAt(EgtbFileHandle handle, char* buf, i64 sz, i64 offset);
+
+    // Size and last modified time (seconds) of a file or a directory
+    bool getFileStat(const std::string& path, i64& sz, i64& mtime);
+
+    // Read-only memory mapping of a whole file, return nullptr if failed
+    const char* mapFile(const std::string& path, i64& sz);
+    void unmapFile(const char* data, i64 sz);
 
     int decompress(char *dst, int uncompresslen, const char *src, int slen);
-    i64 decompressAllBlocks(int blocksize, int blocknum, u32* blocktable, char *dest, i64 uncompressedlen, const char *src, i64 slen);
+
+    // Decoding a compressed block step by step, only up to the size needed. It could be continued later to
+    // get more data. An object should be used by one thread only
+    class EgtbDecodeStream {
+    public:
+        EgtbDecodeStream();
+        ~EgtbDecodeStream();
+
+        // src must be filled with the compressed data of the block before calling begin
+        void    begin(u64 key, int srcLen, int dstLen);
+        bool    decodeTo(int need);
+        bool    isComplete() const { return decodedSz == dstLen; }
+
+        // the block is given up, it is remembered to be decoded wholly if it is missed again
+        void    drop();
+        bool    isDropped(u64 key) const;
+
+        u64     key;        // zero if no block
+        int     srcLen, srcPos, dstLen, decodedSz;
+        char    *src, *dst;     // sizes are of the largest blocks
+
+    private:
+        void*   dec;        // CLzmaDec
+        u64     droppedKeys[EGTB_DECODE_DROPPED_KEYS];
+        int     droppedIdx;
+    };
+
+    // Number of decompressed blocks and time (nanoseconds) spent by all threads. They are counted only
+    // when built with EGTB_DECOMPRESS_STATS (timing every block is not free), otherwise they are zero
+    void getDecompressStats(i64& cnt, i64& nanoseconds);
+    void resetDecompressStats();
+    class EgtbBlockTable;
+    i64 decompressAllBlocks(int blocksize, const EgtbBlockTable& blocktable, char *dest, i64 uncompressedlen, const char *src, i64 slen);
 
     // set it to true if you want to print out more messages
     extern bool egtbVerbose;
@@ -218,19 +296,29 @@ namespace egtb {
     class Piece;
     class Move;
     class MoveList;
+    class Hist;
     class EgtbFile;
     class EgtbDb;
     class EgtbBoardCore;
+    class EgtbBoard;
     class EgtbMailBoard;
     class EgtbKeyRec;
     class EgtbKey;
+    class EgtbBlockCache;
+    class EgtbIoRequest;
+    class EgtbCatalogRec;
 
 } // namespace egtb
 
 #include "EgtbBoard.h"
+#include "EgtbBlockTable.h"
+#include "EgtbPackedCells.h"
+#include "EgtbKey.h"
 #include "EgtbFile.h"
 #include "EgtbDb.h"
-#include "EgtbKey.h"
+#include "EgtbBlockCache.h"
+#include "EgtbIoRing.h"
+#include "EgtbCatalog.h"
 
 
 #endif
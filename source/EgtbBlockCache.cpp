@@ -0,0 +1,363 @@
+/*
+ This file is part of NhatMinh Egtb, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#include "Egtb.h"
+#include "EgtbBlockCache.h"
+
+namespace egtb {
+    EgtbBlockCache egtbBlockCache;
+} // namespace
+
+using namespace egtb;
+
+thread_local EgtbBlockCache::ThreadCache EgtbBlockCache::threadCache;
+
+EgtbBlockCache::ThreadCache::ThreadCache() {
+    store = nullptr;
+    for(int i = 0; i < EGTB_BLOCK_CACHE_L1_SIZE; i++) {
+        keys[i] = 0;
+        data[i] = nullptr;
+        slots[i] = nullptr;
+    }
+}
+
+EgtbBlockCache::ThreadCache::~ThreadCache() {
+    reset();
+}
+
+// Unpin all slots
+void EgtbBlockCache::ThreadCache::reset() {
+    for(int i = 0; i < EGTB_BLOCK_CACHE_L1_SIZE; i++) {
+        set(i, 0, nullptr);
+    }
+    store = nullptr;
+}
+
+// The new slot must be pinned already by the caller
+void EgtbBlockCache::ThreadCache::set(int idx, u64 key, Slot* slot) {
+    if (slots[idx]) {
+        slots[idx]->refCnt.fetch_sub(1, std::memory_order_release);
+    }
+    keys[idx] = key;
+    slots[idx] = slot;
+    data[idx] = slot ? slot->data : nullptr;
+}
+
+EgtbBlockCache::Store::Store(i64 slotCnt) {
+    ways = (int)MIN(slotCnt, (i64)EGTB_BLOCK_CACHE_WAYS);
+    setCnt = (int)(slotCnt / ways);
+
+    auto n = setCnt * ways;
+    slots = new Slot[n];
+    hands = new u8[setCnt];
+    pool = (char*)malloc((i64)n * EGTB_SIZE_CACHE_PAGE);
+
+    memset(hands, 0, setCnt);
+    for(int i = 0; i < n; i++) {
+        slots[i].version = 0;
+        slots[i].key = 0;
+        slots[i].referenced = 0;
+        slots[i].refCnt = 0;
+        slots[i].data = pool + (i64)i * EGTB_SIZE_CACHE_PAGE;
+    }
+}
+
+EgtbBlockCache::Store::~Store() {
+    delete [] slots;
+    delete [] hands;
+    free(pool);
+}
+
+bool EgtbBlockCache::Store::isPinned() const {
+    for(int i = 0, n = setCnt * ways; i < n; i++) {
+        if (slots[i].refCnt.load()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The store is allocated at the first add, not when the program starts
+EgtbBlockCache::EgtbBlockCache() {
+    store = nullptr;
+    maxSize = EGTB_BLOCK_CACHE_SIZE;
+#ifdef EGTB_CACHE_STATS
+    hitCnt = missCnt = 0;
+#endif
+}
+
+EgtbBlockCache::~EgtbBlockCache() {
+    delete store.load();
+    for (auto && s : retiredStores) {
+        delete s;
+    }
+}
+
+EgtbBlockCache::Store* EgtbBlockCache::createStore() {
+    std::lock_guard<std::mutex> thelock(storeMtx);
+    auto s = store.load();
+    auto slotCnt = maxSize / EGTB_SIZE_CACHE_PAGE;
+    if (s == nullptr && slotCnt > 0) {
+        s = new Store(slotCnt);
+        store.store(s, std::memory_order_release);
+    }
+    return s;
+}
+
+// Thread caches of other threads may still pin slots of retired stores, those stores
+// are kept until a later call. Must be called when storeMtx is locked
+void EgtbBlockCache::freeRetiredStores() {
+    threadCache.reset();
+
+    for(size_t i = 0; i < retiredStores.size();) {
+        if (retiredStores[i]->isPinned()) {
+            i++;
+            continue;
+        }
+        delete retiredStores[i];
+        retiredStores.erase(retiredStores.begin() + i);
+    }
+}
+
+// The old store is retired, the new one is allocated by the next add
+void EgtbBlockCache::setSize(i64 sz) {
+    std::lock_guard<std::mutex> thelock(storeMtx);
+    maxSize = MAX(0, sz);
+
+    auto oldStore = store.exchange(nullptr);
+    if (oldStore) {
+        retiredStores.push_back(oldStore);
+    }
+    freeRetiredStores();
+}
+
+void EgtbBlockCache::clear() {
+    std::lock_guard<std::mutex> thelock(storeMtx);
+    freeRetiredStores();
+
+    auto s = store.load();
+    if (s == nullptr) {
+        return;
+    }
+
+    // pinned slots are kept, their data is still valid
+    for(int i = 0; i < s->setCnt; i++) {
+        std::lock_guard<std::mutex> stripeLock(stripes[i % EGTB_BLOCK_CACHE_STRIPES]);
+        for(int j = 0; j < s->ways; j++) {
+            auto& slot = s->slots[i * s->ways + j];
+            if (slot.key.load(std::memory_order_relaxed) && beginWrite(slot)) {
+                slot.key.store(0, std::memory_order_relaxed);
+                slot.referenced.store(0, std::memory_order_relaxed);
+                endWrite(slot);
+            }
+        }
+    }
+}
+
+bool EgtbBlockCache::getCell(u64 key, int offset, char& cell) {
+#ifdef EGTB_CACHE_STATS
+    bool r = find(key, offset, cell);
+    (r ? hitCnt : missCnt).fetch_add(1, std::memory_order_relaxed);
+    return r;
+#else
+    return find(key, offset, cell);
+#endif
+}
+
+#ifdef EGTB_CACHE_STATS
+void EgtbBlockCache::getStats(i64& hits, i64& misses) const {
+    hits = hitCnt;
+    misses = missCnt;
+}
+
+void EgtbBlockCache::resetStats() {
+    hitCnt = missCnt = 0;
+}
+#else
+void EgtbBlockCache::getStats(i64& hits, i64& misses) const {
+    hits = misses = 0;
+}
+
+void EgtbBlockCache::resetStats() {
+}
+#endif
+
+inline bool EgtbBlockCache::find(u64 key, int offset, char& cell) {
+    assert(offset >= 0 && offset < EGTB_SIZE_CACHE_PAGE);
+
+    // thread cache first, its slots are pinned thus could be read without any check
+    auto l1Idx = ThreadCache::getIdx(key);
+    if (threadCache.keys[l1Idx] == key) {
+        cell = threadCache.data[l1Idx][offset];
+        return true;
+    }
+
+    auto s = store.load(std::memory_order_acquire);
+    if (s == nullptr) {
+        return false;
+    }
+
+    // slots pinned in an old store (the cache has been resized) are released
+    if (threadCache.store != s) {
+        threadCache.reset();
+        threadCache.store = s;
+    }
+
+    auto set = s->slots + s->getSetIdx(key) * s->ways;
+    for(int i = 0; i < s->ways; i++) {
+        auto& slot = set[i];
+        if (slot.key.load(std::memory_order_relaxed) != key) {
+            continue;
+        }
+
+        auto version = slot.version.load(std::memory_order_acquire);
+        if (version & 1) {
+            return false;
+        }
+
+        // pin, then check that no writer has started meanwhile (see beginWrite)
+        slot.refCnt.fetch_add(1);
+        if (slot.version.load() != version || slot.key.load(std::memory_order_relaxed) != key) {
+            slot.refCnt.fetch_sub(1);
+            return false;
+        }
+
+        if (!slot.referenced.load(std::memory_order_relaxed)) {
+            slot.referenced.store(1, std::memory_order_relaxed);
+        }
+
+        threadCache.set(l1Idx, key, &slot);
+        cell = slot.data[offset];
+        return true;
+    }
+
+    return false;
+}
+
+// A quick check without any lock, the block may be evicted right after that
+bool EgtbBlockCache::has(u64 key) const {
+    auto s = store.load(std::memory_order_acquire);
+    if (s == nullptr) {
+        return false;
+    }
+
+    auto set = s->slots + s->getSetIdx(key) * s->ways;
+    for(int i = 0; i < s->ways; i++) {
+        if (set[i].key.load(std::memory_order_relaxed) == key) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Must be called when the stripe of the slot is locked. The version is made odd before
+// checking pins so a reader pinning at the same time either is seen here or sees
+// the new version and gives up
+bool EgtbBlockCache::beginWrite(Slot& slot) {
+    if (slot.refCnt.load(std::memory_order_relaxed)) {
+        return false;
+    }
+
+    auto version = slot.version.load(std::memory_order_relaxed);
+    slot.version.store(version + 1);
+
+    if (slot.refCnt.load()) {
+        slot.version.store(version + 2, std::memory_order_release);
+        return false;
+    }
+    return true;
+}
+
+void EgtbBlockCache::endWrite(Slot& slot) {
+    auto version = slot.version.load(std::memory_order_relaxed);
+    assert(version & 1);
+    slot.version.store(version + 1, std::memory_order_release);
+}
+
+void EgtbBlockCache::add(u64 key, const char* data, int len, bool useThreadCache) {
+    assert(key && len > 0 && len <= EGTB_SIZE_CACHE_PAGE);
+
+    auto s = store.load(std::memory_order_acquire);
+    if (s == nullptr) {
+        s = createStore();
+        if (s == nullptr) {
+            return;
+        }
+    }
+
+    auto setIdx = s->getSetIdx(key);
+    auto set = s->slots + setIdx * s->ways;
+
+    std::lock_guard<std::mutex> thelock(stripes[setIdx % EGTB_BLOCK_CACHE_STRIPES]);
+
+    Slot* slot = nullptr;
+    for(int i = 0; i < s->ways; i++) {
+        if (set[i].key.load(std::memory_order_relaxed) == key) {
+            slot = &set[i];
+            break;
+        }
+    }
+
+    if (slot == nullptr) {
+        // clock: skip and clear recently referenced slots, at most two rounds
+        auto& hand = s->hands[setIdx];
+        for(int i = 0; i < 2 * s->ways; i++) {
+            auto& victim = set[hand];
+            hand = (hand + 1) % s->ways;
+
+            if (victim.key.load(std::memory_order_relaxed) && victim.referenced.load(std::memory_order_relaxed)) {
+                victim.referenced.store(0, std::memory_order_relaxed);
+                continue;
+            }
+
+            if (beginWrite(victim)) {
+                victim.key.store(key, std::memory_order_relaxed);
+                memcpy(victim.data, data, len);
+                victim.referenced.store(1, std::memory_order_relaxed);
+                endWrite(victim);
+                slot = &victim;
+                break;
+            }
+        }
+
+        // all slots of the set are pinned
+        if (slot == nullptr) {
+            return;
+        }
+    }
+
+    if (!useThreadCache) {
+        return;
+    }
+
+    if (threadCache.store != s) {
+        threadCache.reset();
+        threadCache.store = s;
+    }
+
+    // writers need the stripe lock, thus the slot could be pinned safely here
+    slot->refCnt.fetch_add(1);
+    threadCache.set(ThreadCache::getIdx(key), key, slot);
+}
+
@@ -0,0 +1,149 @@
+/*
+ This file is part of NhatMinh Egtb, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#ifndef EgtbBlockCache_h
+#define EgtbBlockCache_h
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "Egtb.h"
+
+#define EGTB_BLOCK_CACHE_WAYS       8
+#define EGTB_BLOCK_CACHE_STRIPES    64
+#define EGTB_BLOCK_CACHE_L1_SIZE    16     // must be a power of two
+
+namespace egtb {
+
+    /*
+     * Decompressed blocks shared by all EgtbFile instances (tiny, mapped and compressed modes).
+     * Blocks are keyed by file, side and block index. The cache is a set-associative
+     * table of fixed size slots, evicted by the clock (second chance) algorithm.
+     * Hits read slots under sequence locks thus they need no lock; adding a block locks
+     * only one of EGTB_BLOCK_CACHE_STRIPES mutexes, selected by the set of the key.
+     *
+     * In front of the shared table, each thread has a small direct-mapped cache (L1) of
+     * recently used slots. Those slots are pinned by reference counts and never evicted
+     * while in use, so a repeated hit is a plain memory read, no atomic nor lock.
+     *
+     * The table is allocated at the first add. Resizing retires the old table, it is freed
+     * (by setSize or clear) once no thread cache pins its slots. Those two functions must
+     * not be called while other threads are probing.
+     */
+    class EgtbBlockCache {
+    public:
+        EgtbBlockCache();
+        ~EgtbBlockCache();
+
+        static u64 makeKey(u32 fileId, int sd, i64 blockIdx) {
+            return (u64)fileId << 33 | (u64)sd << 32 | (u64)blockIdx;
+        }
+
+        void    setSize(i64 sz);
+        i64     getSize() const { return maxSize; }
+
+        bool    getCell(u64 key, int offset, char& cell);
+        bool    has(u64 key) const;
+        void    add(u64 key, const char* data, int len, bool useThreadCache = true);
+
+        void    clear();
+
+        // Numbers of hits and misses of getCell, counted only when built with EGTB_CACHE_STATS
+        void    getStats(i64& hits, i64& misses) const;
+        void    resetStats();
+
+    private:
+        class Slot {
+        public:
+            std::atomic<u32>    version;    // odd while the slot is being written
+            std::atomic<u64>    key;        // zero when the slot is empty
+            std::atomic<u8>     referenced;
+            std::atomic<int>    refCnt;     // number of thread caches pinning the slot
+            char*               data;
+        };
+
+        class ThreadCache {
+        public:
+            ThreadCache();
+            ~ThreadCache();
+
+            static int getIdx(u64 key) {
+                return (int)(((key * 0x9E3779B97F4A7C15ULL) >> 32) & (EGTB_BLOCK_CACHE_L1_SIZE - 1));
+            }
+
+            void    set(int idx, u64 key, Slot* slot);
+            void    reset();
+
+            const void* store;  // the store of pinned slots
+            u64     keys[EGTB_BLOCK_CACHE_L1_SIZE];
+            const char* data[EGTB_BLOCK_CACHE_L1_SIZE];
+            Slot*   slots[EGTB_BLOCK_CACHE_L1_SIZE];
+        };
+
+        class Store {
+        public:
+            Store(i64 slotCnt);
+            ~Store();
+
+            int     getSetIdx(u64 key) const {
+                return (int)(((key * 0x9E3779B97F4A7C15ULL) >> 32) % (u64)setCnt);
+            }
+
+            bool    isPinned() const;
+
+            Slot*   slots;
+            u8*     hands;
+            char*   pool;
+            int     setCnt, ways;
+        };
+
+        bool    find(u64 key, int offset, char& cell);
+        bool    beginWrite(Slot& slot);
+        void    endWrite(Slot& slot);
+
+        Store*  createStore();
+        void    freeRetiredStores();
+
+        static thread_local ThreadCache threadCache;
+
+        std::atomic<Store*> store;
+        std::vector<Store*> retiredStores;
+
+        mutable std::mutex  stripes[EGTB_BLOCK_CACHE_STRIPES];
+        std::mutex  storeMtx;
+
+        i64     maxSize;
+
+#ifdef EGTB_CACHE_STATS
+        std::atomic<i64> hitCnt, missCnt;
+#endif
+    };
+
+    extern EgtbBlockCache egtbBlockCache;
+
+} // namespace egtb
+
+#endif /* EgtbBlockCache_h */
+
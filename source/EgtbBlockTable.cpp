@@ -0,0 +1,168 @@
+/*
+ This file is part of NhatMinh Egtb, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#include "Egtb.h"
+#include "EgtbBlockTable.h"
+
+using namespace egtb;
+
+EgtbBlockTable::EgtbBlockTable() {
+    entries = nullptr;
+    owned = wide = false;
+    blockCnt = 0;
+    groups = nullptr;
+    starts = nullptr;
+    dataSize = 0;
+    groupShift = EGTB_BLOCK_GROUP_SHIFT_MAX;
+}
+
+EgtbBlockTable::~EgtbBlockTable() {
+    reset();
+}
+
+void EgtbBlockTable::init(i64 _blockCnt, bool _wide) {
+    reset();
+    blockCnt = _blockCnt;
+    wide = _wide;
+}
+
+void EgtbBlockTable::reset() {
+    if (entries && owned) {
+        free((void*)entries);
+    }
+    entries = nullptr;
+    owned = false;
+
+    if (groups) {
+        free(groups);
+        free(starts);
+        groups = nullptr;
+        starts = nullptr;
+    }
+}
+
+// Take the entries of other, other becomes empty
+void EgtbBlockTable::moveFrom(EgtbBlockTable& other) {
+    reset();
+    entries = other.entries;
+    owned = other.owned;
+    wide = other.wide;
+    blockCnt = other.blockCnt;
+    groups = other.groups;
+    starts = other.starts;
+    dataSize = other.dataSize;
+    groupShift = other.groupShift;
+
+    other.entries = nullptr;
+    other.owned = false;
+    other.groups = nullptr;
+    other.starts = nullptr;
+}
+
+// Read the table from the current position of file (right after the header)
+bool EgtbBlockTable::read(std::ifstream& file) {
+    reset();
+    auto sz = getTableSize();
+    auto buf = (char*)malloc(sz + 64);
+    if (buf == nullptr || !file.read(buf, sz)) {
+        free(buf);
+        return false;
+    }
+    entries = buf;
+    owned = true;
+    return true;
+}
+
+// The table is in memory already (mapped file), it must outlive the object
+void EgtbBlockTable::attach(const char* data) {
+    reset();
+    entries = data;
+}
+
+// Convert the entries into the compact form, with groups as large as possible. Return false (the table
+// is kept as it is) if groups must be too small for offsets of blocks
+bool EgtbBlockTable::compact() {
+    if (entries == nullptr || blockCnt == 0) {
+        return false;
+    }
+
+    for (int shift = EGTB_BLOCK_GROUP_SHIFT_MAX; shift >= EGTB_BLOCK_GROUP_SHIFT_MIN; shift--) {
+        if (compact(shift)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Return false if some block is too far from the start of its group
+bool EgtbBlockTable::compact(int shift) {
+    auto groupSize = (i64)1 << shift;
+    auto groupCnt = (blockCnt + groupSize - 1) >> shift;
+    auto newGroups = (EgtbBlockGroup*)malloc(groupCnt * sizeof(EgtbBlockGroup));
+    auto newStarts = (u16*)malloc(blockCnt * sizeof(u16));
+    bool ok = newGroups && newStarts;
+
+    for (i64 i = 0; ok && i < blockCnt; i++) {
+        i64 offset, sz;
+        bool iscompressed;
+        getBlock(i, offset, sz, iscompressed);
+
+        auto& group = newGroups[i >> shift];
+        if ((i & (groupSize - 1)) == 0) {
+            group.offset = offset;
+            group.uncompressedMask = 0;
+        }
+        if (sz < 1 || offset - group.offset > 0xffff) {
+            ok = false;
+            break;
+        }
+        if (!iscompressed) {
+            group.uncompressedMask |= 1ULL << (i & (groupSize - 1));
+        }
+        newStarts[i] = (u16)(offset - group.offset);
+    }
+
+    if (!ok) {
+        free(newGroups);
+        free(newStarts);
+        return false;
+    }
+
+    dataSize = getDataSize();
+    auto cnt = blockCnt;
+    reset();
+    blockCnt = cnt;
+    groups = newGroups;
+    starts = newStarts;
+    groupShift = shift;
+    return true;
+}
+
+// Memory used by the entries (zero if they are in a mapped file)
+i64 EgtbBlockTable::getMemSize() const {
+    if (groups) {
+        return (((blockCnt - 1) >> groupShift) + 1) * sizeof(EgtbBlockGroup) + blockCnt * sizeof(u16);
+    }
+    return owned ? getTableSize() : 0;
+}
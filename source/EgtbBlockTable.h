@@ -0,0 +1,124 @@
+/*
+ This file is part of NhatMinh Egtb, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#ifndef EgtbBlockTable_h
+#define EgtbBlockTable_h
+
+#include <fstream>
+
+#include "Egtb.h"
+
+// blocks of a group of the compact form (as shifts): up to the number of bits of EgtbBlockGroup::uncompressedMask,
+// down to 16 blocks (3 bytes a block, groups of 8 would cost as much as 32-bit entries)
+#define EGTB_BLOCK_GROUP_SHIFT_MAX  6
+#define EGTB_BLOCK_GROUP_SHIFT_MIN  4
+
+namespace egtb {
+
+    class EgtbBlockGroup {
+    public:
+        i64     offset;             // of the first block of the group
+        u64     uncompressedMask;
+    };
+
+    /*
+     * Block table of a compressed side: cumulative ends of compressed blocks, the top bit of
+     * an entry is set if the block is stored uncompressed. V0 and V1 files have 32-bit entries
+     * (compressed data up to 2 GB), V2 files 64-bit ones. The entries are read into memory or
+     * point inside a mapped file.
+     *
+     * Tables kept in memory for probing could be compacted: an absolute offset and the flags of
+     * every group of blocks, and a 16-bit offset of each block from the start of its group (about 2.25 bytes
+     * per block instead of 4 or 8). Groups have 64 blocks, 32 or 16 (up to 3 bytes per block) if some group
+     * would be over 64 KB, otherwise the table is kept as it is.
+     * A block offset is its group offset plus its entry, its size is up to the offset of the next block.
+     */
+    class EgtbBlockTable {
+    public:
+        EgtbBlockTable();
+        ~EgtbBlockTable();
+
+        void    init(i64 blockCnt, bool wide);
+        void    reset();
+        void    moveFrom(EgtbBlockTable& other);
+
+        bool    read(std::ifstream& file);
+        void    attach(const char* data);
+        bool    compact();
+
+        bool    isEmpty() const { return entries == nullptr && groups == nullptr; }
+        i64     getMemSize() const;
+        i64     getBlockCount() const { return blockCnt; }
+
+        // Size in the file, compressed data starts right after it
+        i64     getTableSize() const { return blockCnt * (wide ? sizeof(u64) : sizeof(u32)); }
+        i64     getDataSize() const { return groups ? dataSize : getEnd(blockCnt - 1); }
+
+        // Offset (from the start of compressed data) and size of a block
+        void    getBlock(i64 blockIdx, i64& offset, i64& sz, bool& iscompressed) const {
+            if (groups) {
+                offset = getCompactOffset(blockIdx);
+                sz = getCompactOffset(blockIdx + 1) - offset;
+            } else {
+                offset = blockIdx == 0 ? 0 : getEnd(blockIdx - 1);
+                sz = getEnd(blockIdx) - offset;
+            }
+            iscompressed = isBlockCompressed(blockIdx);
+        }
+
+        bool    isBlockCompressed(i64 blockIdx) const {
+            if (groups) {
+                return !(groups[blockIdx >> groupShift].uncompressedMask & (1ULL << (blockIdx & ((1 << groupShift) - 1))));
+            }
+            return wide ? !(((const u64*)entries)[blockIdx] & EGTB_UNCOMPRESS_BIT64)
+                        : !(((const u32*)entries)[blockIdx] & EGTB_UNCOMPRESS_BIT);
+        }
+
+    private:
+        i64     getEnd(i64 blockIdx) const {
+            return wide ? (i64)(((const u64*)entries)[blockIdx] & ~EGTB_UNCOMPRESS_BIT64)
+                        : (i64)(((const u32*)entries)[blockIdx] & ~EGTB_UNCOMPRESS_BIT);
+        }
+
+        // blockIdx could be the block count, the end of all data
+        i64     getCompactOffset(i64 blockIdx) const {
+            return blockIdx < blockCnt ? groups[blockIdx >> groupShift].offset + starts[blockIdx] : dataSize;
+        }
+
+        bool    compact(int shift);
+
+        const char* entries;
+        bool    owned, wide;
+        i64     blockCnt;
+
+        // compact form, entries are released
+        EgtbBlockGroup* groups;
+        u16*    starts;             // offsets from the starts of groups
+        i64     dataSize;
+        int     groupShift;
+    };
+
+} // namespace egtb
+
+#endif /* EgtbBlockTable_h */
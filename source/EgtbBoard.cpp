@@ -22,6 +22,7 @@
  SOFTWARE.
  */
 
+#include "Egtb.h"
 #include "EgtbBoard.h"
 
 namespace egtb {
@@ -0,0 +1,177 @@
+/*
+ This file is part of NhatMinh Egtb, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#include <fstream>
+
+#include "Egtb.h"
+#include "EgtbCatalog.h"
+
+using namespace egtb;
+
+static bool copyPath(char* dest, const std::string& path) {
+    if (path.size() >= EGTB_CATALOG_PATH_SIZE) {
+        return false;
+    }
+    memset(dest, 0, EGTB_CATALOG_PATH_SIZE);
+    memcpy(dest, path.c_str(), path.size());
+    return true;
+}
+
+// Scan the folder, read headers of all endgame files and write the catalog into the folder
+bool EgtbCatalog::create(const std::string& folder) {
+    std::vector<EgtbCatalogRec> recs;
+    std::vector<EgtbCatalogDirRec> dirRecs;
+    std::vector<std::string> dirs;
+
+    for (auto && path : listdir(folder, &dirs)) {
+        if (!EgtbFile::knownExtension(path)) {
+            continue;
+        }
+
+        EgtbCatalogRec rec;
+        memset(&rec, 0, sizeof(rec));
+
+        auto relativePath = path.substr(folder.size() + 1);
+        EgtbFileHeader header;
+        std::ifstream file(path, std::ios::binary);
+        if (!file || !header.readFile(file) || !header.isValid()
+            || !copyPath(rec.path, relativePath)
+            || !getFileStat(path, rec.fileSize, rec.mtime)) {
+            std::cerr << "Error: cannot add to the catalog: " << path << std::endl;
+            continue;
+        }
+        file.close();
+
+        memcpy(rec.header, &header, EGTB_HEADER_SIZE);
+        rec.side = header.isSide(Side::white) ? W : B;
+        rec.order = header.order;
+        rec.size = EgtbFile::computeSize(header.name);
+        if (header.property & EGTB_PROP_COMPRESSED) {
+            rec.blockCnt = (u32)((rec.size + header.getBlockSize() - 1) / header.getBlockSize());
+            rec.blockTableOffset = EGTB_HEADER_SIZE;
+        }
+        recs.push_back(rec);
+    }
+
+    // relative paths of all directories scanned, the folder itself is the empty one
+    for (auto && dir : dirs) {
+        EgtbCatalogDirRec dirRec;
+        memset(&dirRec, 0, sizeof(dirRec));
+        if (!copyPath(dirRec.path, dir.size() > folder.size() ? dir.substr(folder.size() + 1) : "")) {
+            return false;
+        }
+        dirRecs.push_back(dirRec);
+    }
+
+    FileHeader fileHeader;
+    fileHeader.signature = EGTB_ID_CATALOG_V0;
+    fileHeader.fileCnt = (u32)recs.size();
+    fileHeader.dirCnt = (u32)dirRecs.size();
+    fileHeader.notused = 0;
+
+    auto catalogPath = folder + "/" + EGTB_CATALOG_FILENAME;
+    std::ofstream outfile(catalogPath, std::ios::binary);
+    outfile.write((const char*)&fileHeader, sizeof(fileHeader));
+    if (!recs.empty()) {
+        outfile.write((const char*)recs.data(), recs.size() * sizeof(EgtbCatalogRec));
+    }
+    outfile.write((const char*)dirRecs.data(), dirRecs.size() * sizeof(EgtbCatalogDirRec));
+    outfile.close();
+
+    // creating the catalog changes the modified time of the folder, thus directory times are taken
+    // after that and written over (that doesn't change the time again)
+    bool r = (bool)outfile;
+    for (auto && dirRec : dirRecs) {
+        std::string dir = dirRec.path;
+        i64 sz;
+        r = r && getFileStat(dir.empty() ? folder : folder + "/" + dir, sz, dirRec.mtime);
+    }
+
+    if (r) {
+        std::fstream file(catalogPath, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(sizeof(fileHeader) + recs.size() * sizeof(EgtbCatalogRec), std::ios::beg);
+        file.write((const char*)dirRecs.data(), dirRecs.size() * sizeof(EgtbCatalogDirRec));
+        file.close();
+        r = (bool)file;
+    }
+
+    if (!r) {
+        std::cerr << "Error: cannot write " << catalogPath << std::endl;
+    }
+    return r;
+}
+
+// Return false if the folder has no catalog or it is out of date
+bool EgtbCatalog::load(const std::string& folder_) {
+    folder = folder_;
+    recs.clear();
+
+    i64 sz;
+    auto catalogPath = folder + "/" + EGTB_CATALOG_FILENAME;
+    auto data = mapFile(catalogPath, sz);
+    if (data == nullptr) {
+        return false;
+    }
+
+    FileHeader fileHeader;
+    bool r = sz >= (i64)sizeof(fileHeader);
+    if (r) {
+        memcpy(&fileHeader, data, sizeof(fileHeader));
+        r = fileHeader.signature == EGTB_ID_CATALOG_V0
+            && sz == (i64)(sizeof(fileHeader) + fileHeader.fileCnt * sizeof(EgtbCatalogRec) + fileHeader.dirCnt * sizeof(EgtbCatalogDirRec));
+    }
+
+    if (r) {
+        auto p = data + sizeof(fileHeader);
+        recs.resize(fileHeader.fileCnt);
+        if (fileHeader.fileCnt) {
+            memcpy(recs.data(), p, fileHeader.fileCnt * sizeof(EgtbCatalogRec));
+        }
+        p += fileHeader.fileCnt * sizeof(EgtbCatalogRec);
+
+        for(u32 i = 0; i < fileHeader.dirCnt && r; i++) {
+            EgtbCatalogDirRec dirRec;
+            memcpy(&dirRec, p + i * sizeof(EgtbCatalogDirRec), sizeof(dirRec));
+            dirRec.path[EGTB_CATALOG_PATH_SIZE - 1] = 0;
+
+            std::string dir = dirRec.path;
+            i64 fileSize, mtime;
+            r = getFileStat(dir.empty() ? folder : folder + "/" + dir, fileSize, mtime) && mtime == dirRec.mtime;
+        }
+
+        for (auto && rec : recs) {
+            rec.path[EGTB_CATALOG_PATH_SIZE - 1] = 0;
+        }
+    }
+
+    unmapFile(data, sz);
+
+    if (!r) {
+        recs.clear();
+        if (egtbVerbose) {
+            std::cerr << "Warning: catalog is invalid or out of date, folder is scanned instead: " << catalogPath << std::endl;
+        }
+    }
+    return r;
+}
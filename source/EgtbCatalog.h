@@ -0,0 +1,83 @@
+/*
+ This file is part of NhatMinh Egtb, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#ifndef EgtbCatalog_h
+#define EgtbCatalog_h
+
+#include <vector>
+#include <string>
+
+#include "Egtb.h"
+
+#define EGTB_CATALOG_FILENAME       "egtb.cat"
+#define EGTB_ID_CATALOG_V0          23460
+#define EGTB_CATALOG_PATH_SIZE      160
+
+namespace egtb {
+
+    // One endgame file, written as is into the catalog
+    class EgtbCatalogRec {
+    public:
+        char    path[EGTB_CATALOG_PATH_SIZE];   // relative to the folder of the catalog
+        char    header[EGTB_HEADER_SIZE];       // raw header of the file
+        i64     fileSize, mtime;
+        i64     size;                           // number of cells
+        i64     blockTableOffset;               // zero if the file is not compressed
+        u32     order, blockCnt;
+        u8      side, notused[7];
+    };
+
+    // All directories scanned. Their modified times change when files or subfolders are added or removed
+    class EgtbCatalogDirRec {
+    public:
+        char    path[EGTB_CATALOG_PATH_SIZE];
+        i64     mtime;
+    };
+
+    /*
+     * Catalog of a folder of endgames. It has all information to register endgames,
+     * thus preloading a folder with a valid catalog doesn't need to list the folder nor to
+     * open any file. The catalog is invalid when some directories have been changed; a file changed
+     * after creating the catalog is detected (by its size and modified time, its block count and table offset
+     * are checked too) and rejected when it is loaded.
+     */
+    class EgtbCatalog {
+    public:
+        static bool create(const std::string& folder);
+
+        bool    load(const std::string& folder);
+
+        std::string folder;
+        std::vector<EgtbCatalogRec> recs;
+
+    private:
+        class FileHeader {
+        public:
+            u32     signature, fileCnt, dirCnt, notused;
+        };
+    };
+
+} // namespace egtb
+
+#endif /* EgtbCatalog_h */
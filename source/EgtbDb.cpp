@@ -29,6 +29,7 @@
 using namespace egtb;
 
 EgtbDb::EgtbDb() {
+    prefetchStop = false;
 }
 
 EgtbDb::~EgtbDb() {
@@ -36,10 +37,19 @@ EgtbDb::~EgtbDb() {
 }
 
 void EgtbDb::closeAll() {
+    stopPrefetch();
+
+    if (preloadFuture.valid()) {
+        preloadFuture.wait();
+        preloadFuture = std::shared_future<void>();
+    }
+
     for (auto && egtbFile : egtbFileVec) {
         delete egtbFile;
     }
+    egtbBlockCache.clear();
     folders.clear();
+    preloadedFolders.clear();
     egtbFileVec.clear();
     nameMap.clear();
 }
@@ -48,6 +58,15 @@ void EgtbDb::removeAllBuffers() {
     for (auto && egtbFile : egtbFileVec) {
         egtbFile->removeBuffers();
     }
+    egtbBlockCache.clear();
+}
+
+void EgtbDb::setCacheSize(i64 sz) {
+    egtbBlockCache.setSize(sz);
+}
+
+i64 EgtbDb::getCacheSize() const {
+    return egtbBlockCache.getSize();
 }
 
 void EgtbDb::setFolders(const std::vector<std::string>& folders_) {
@@ -70,27 +89,89 @@ void EgtbDb::preload(const std::string& folder, EgtbMemMode egtbMemMode, EgtbLoa
 
 void EgtbDb::preload(EgtbMemMode egtbMemMode, EgtbLoadMode loadMode) {
     for (auto && folderName : folders) {
+        if (!preloadedFolders.insert(folderName).second) {
+            continue;
+        }
+
+        // the catalog has all files, no need to scan the folder
+        EgtbCatalog catalog;
+        if (catalog.load(folderName)) {
+            for (auto && rec : catalog.recs) {
+                preloadFile(folderName + "/" + rec.path, egtbMemMode, loadMode, &rec);
+            }
+            continue;
+        }
+
         auto vec = listdir(folderName);
 
         for (auto && path : vec) {
             if (EgtbFile::knownExtension(path)) {
-                EgtbFile *egtbFile = new EgtbFile();
-                if (egtbFile->preload(path, egtbMemMode, loadMode)) {
-                    auto pos = nameMap.find(egtbFile->getName());
-                    if (pos == nameMap.end()) {
-                        addEgtbFile(egtbFile);
-                        continue;
-                    }
-                    pos->second->merge(*egtbFile);
-                } else {
-                    std::cout << "Error: not loaded: " << path << std::endl;
-                }
-                free(egtbFile);
+                preloadFile(path, egtbMemMode, loadMode, nullptr);
             }
         }
     }
 }
 
+void EgtbDb::preloadFile(const std::string& path, EgtbMemMode egtbMemMode, EgtbLoadMode loadMode, const EgtbCatalogRec* catalogRec) {
+    EgtbFile *egtbFile = new EgtbFile();
+    egtbFile->setImageFolder(imageFolder);
+    if (egtbFile->preload(path, egtbMemMode, loadMode, catalogRec)) {
+        auto pos = nameMap.find(egtbFile->getName());
+        if (pos == nameMap.end()) {
+            addEgtbFile(egtbFile);
+            return;
+        }
+        pos->second->merge(*egtbFile);
+    } else {
+        std::cout << "Error: not loaded: " << path << std::endl;
+    }
+    delete egtbFile;
+}
+
+bool EgtbDb::createCatalog(const std::string& folder) {
+    return EgtbCatalog::create(folder);
+}
+
+std::shared_future<void> EgtbDb::preloadParallel(EgtbMemMode egtbMemMode, int threadCnt, std::function<void(EgtbFile*)> callback) {
+    if (preloadFuture.valid()) {
+        preloadFuture.wait();
+    }
+
+    // register files as on request mode, thus the name map is completed before loading
+    auto oldSz = egtbFileVec.size();
+    preload(egtbMemMode, EgtbLoadMode::onrequest);
+    std::vector<EgtbFile*> vec(egtbFileVec.begin() + oldSz, egtbFileVec.end());
+
+    if (threadCnt <= 0) {
+        threadCnt = MAX(1, (int)std::thread::hardware_concurrency());
+    }
+    threadCnt = MIN(threadCnt, MAX(1, (int)vec.size()));
+
+    preloadFuture = std::async(std::launch::async, [vec, threadCnt, callback]() {
+        std::atomic<size_t> nextIdx(0);
+        std::vector<std::thread> threads;
+        for(int t = 0; t < threadCnt; t++) {
+            threads.push_back(std::thread([&]() {
+                for(size_t i = nextIdx++; i < vec.size(); i = nextIdx++) {
+                    vec[i]->checkToLoadHeaderAndTable();
+                    if (vec[i]->loadStatus == EgtbLoadStatus::error) {
+                        std::cout << "Error: not loaded: " << vec[i]->getName() << std::endl;
+                    }
+                    if (callback) {
+                        callback(vec[i]);
+                    }
+                }
+            }));
+        }
+
+        for (auto && t : threads) {
+            t.join();
+        }
+    }).share();
+
+    return preloadFuture;
+}
+
 void EgtbDb::addEgtbFile(EgtbFile *egtbFile) {
     egtbFileVec.push_back(egtbFile);
 
@@ -116,27 +197,56 @@ int EgtbDb::getScore(EgtbBoardCore& board) {
     return getScore(board, board.side);
 }
 
+bool EgtbDb::setupProbeContext(EgtbProbeContext& context, const EgtbBoardCore& board) const {
+    EgtbFile* pEgtbFile = getEgtbFile(board);
+    if (pEgtbFile == nullptr || pEgtbFile->loadStatus == EgtbLoadStatus::error) {
+        return false;
+    }
+
+    pEgtbFile->checkToLoadHeaderAndTable();
+    context.egtbFile = pEgtbFile;
+    pEgtbFile->keyPlan.getKey(context.keyState, board);
+    return true;
+}
+
+// The context is of the position before the move of hist, update it for the board (after the move).
+// Return false if the material has been changed (the endgame is another one)
+bool EgtbDb::updateProbeContext(EgtbProbeContext& context, const EgtbBoardCore& board, const Hist& hist) const {
+    if (!hist.cap.isEmpty() || hist.move.promote != PieceType::empty) {
+        return false;
+    }
+
+    // moves of kings may change the flip mode, compute the whole key
+    auto& keyPlan = context.egtbFile->keyPlan;
+    if (!keyPlan.updateKey(context.keyState, board, hist)) {
+        keyPlan.getKey(context.keyState, board);
+    }
+    return true;
+}
+
 int EgtbDb::getScore(EgtbBoardCore& board, Side side) {
     assert(side == Side::white || side == Side::black);
 
-    EgtbFile* pEgtbFile = getEgtbFile(board);
-    if (pEgtbFile == nullptr || pEgtbFile->loadStatus == EgtbLoadStatus::error) {
+    EgtbProbeContext context;
+    if (!setupProbeContext(context, board)) {
         return EGTB_SCORE_MISSING;
     }
+    return getScore(context, board, side);
+}
 
-    pEgtbFile->checkToLoadHeaderAndTable();
-    auto r = pEgtbFile->getKey(board);
-    auto querySide = r.flipSide ? getXSide(side) : side;
+int EgtbDb::getScore(const EgtbProbeContext& context, EgtbBoardCore& board, Side side) {
+    auto pEgtbFile = context.egtbFile;
+    auto querySide = context.keyState.flipSide ? getXSide(side) : side;
 
     if (pEgtbFile->header->isSide(querySide) && board.enpassant <= 0) {
-        int score = pEgtbFile->getScore(r.key, querySide);
+        int score = pEgtbFile->getScore(context.keyState.key, querySide);
         return score;
     }
 
-    return getScoreOnePly(board, side);
+    return getScoreOnePly(context, board, side);
 }
 
-int EgtbDb::getScoreOnePly(EgtbBoardCore& board, Side side) {
+int EgtbDb::getScoreOnePly(const EgtbProbeContext& context, EgtbBoardCore& board, Side side) {
 
     auto xside = getXSide(side);
 
@@ -151,7 +261,8 @@ int EgtbDb::getScoreOnePly(EgtbBoardCore& board, Side side) {
 
         if (!board.isIncheck(side)) {
             legalCnt++;
-            auto score = getScore(board, xside);
+            auto child = context;
+            auto score = updateProbeContext(child, board, hist) ? getScore(child, board, xside) : getScore(board, xside);
 
             if (score == EGTB_SCORE_MISSING && !hist.cap.isEmpty() && board.pieceList_isDraw()) {
                 score = EGTB_SCORE_DRAW;
@@ -174,6 +285,244 @@ int EgtbDb::getScoreOnePly(EgtbBoardCore& board, Side side) {
     return board.isIncheck(side) ? -EGTB_SCORE_MATE : EGTB_SCORE_DRAW;
 }
 
+////////////////////////////////////////////////////////////////////////
+// WDL
+////////////////////////////////////////////////////////////////////////
+
+int EgtbDb::getWdl(EgtbBoardCore& board) {
+    return getWdl(board, board.side);
+}
+
+int EgtbDb::getWdl(EgtbBoardCore& board, Side side) {
+    assert(side == Side::white || side == Side::black);
+
+    EgtbProbeContext context;
+    if (!setupProbeContext(context, board)) {
+        return EGTB_SCORE_MISSING;
+    }
+    return getWdl(context, board, side);
+}
+
+int EgtbDb::getWdl(const EgtbProbeContext& context, EgtbBoardCore& board, Side side) {
+    auto pEgtbFile = context.egtbFile;
+    auto querySide = context.keyState.flipSide ? getXSide(side) : side;
+
+    if (pEgtbFile->header->isSide(querySide) && board.enpassant <= 0) {
+        return pEgtbFile->getWdl(context.keyState.key, querySide);
+    }
+
+    return getWdlOnePly(context, board, side);
+}
+
+int EgtbDb::getWdlOnePly(const EgtbProbeContext& context, EgtbBoardCore& board, Side side) {
+
+    auto xside = getXSide(side);
+
+    MoveList moveList;
+    Hist hist;
+    board.gen(moveList, side, false);
+    int best = EGTB_WDL_LOSS, legalCnt = 0;
+
+    for(int i = 0; i < moveList.end && best != EGTB_WDL_WIN; i++) {
+        auto move = moveList.list[i];
+        board.make(move, hist);
+
+        if (!board.isIncheck(side)) {
+            legalCnt++;
+            auto child = context;
+            auto wdl = updateProbeContext(child, board, hist) ? getWdl(child, board, xside) : getWdl(board, xside);
+
+            if (wdl == EGTB_SCORE_MISSING && !hist.cap.isEmpty() && board.pieceList_isDraw()) {
+                wdl = EGTB_WDL_DRAW;
+            }
+
+            if (abs(wdl) <= EGTB_WDL_WIN) {
+                best = MAX(best, -wdl);
+            }
+        }
+        board.takeBack(hist);
+    }
+
+    if (legalCnt) {
+        return best;
+    }
+
+    return board.isIncheck(side) ? EGTB_WDL_LOSS : EGTB_WDL_DRAW;
+}
+
+bool EgtbDb::createWdlFiles(const std::string& folder) {
+    EgtbDb egtbDb;
+    egtbDb.preload(folder, EgtbMemMode::tiny, EgtbLoadMode::loadnow);
+
+    bool r = egtbDb.getSize() > 0;
+    for (auto && egtbFile : egtbDb.egtbFileVec) {
+        for (int sd = 0; sd < 2; sd++) {
+            auto side = static_cast<Side>(sd);
+            if (egtbFile->header->isSide(side) && !egtbFile->createWdlFile(side)) {
+                r = false;
+            }
+        }
+    }
+    return r;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Prefetch
+////////////////////////////////////////////////////////////////////////
+
+bool EgtbDb::createPrefetchRec(EgtbPrefetchRec& rec, const EgtbBoardCore& board) const {
+    EgtbFile* pEgtbFile = getEgtbFile(board);
+    if (pEgtbFile == nullptr || pEgtbFile->loadStatus == EgtbLoadStatus::error) {
+        return false;
+    }
+
+    // positions with enpassant are queried via their children, too many to prefetch
+    if (board.enpassant > 0) {
+        return false;
+    }
+
+    rec.egtbFile = pEgtbFile;
+    rec.key = -1;
+    rec.side = board.side;
+
+    // the key needs the header, let the background thread load it first then compute the key
+    if (pEgtbFile->loadStatus == EgtbLoadStatus::none) {
+        memcpy(rec.pieceList, board.pieceList, sizeof(rec.pieceList));
+        return true;
+    }
+
+    return setPrefetchKey(rec, board);
+}
+
+// The file of the record must be loaded, rec.side is the side to move
+bool EgtbDb::setPrefetchKey(EgtbPrefetchRec& rec, const EgtbBoardCore& board) {
+    auto r = rec.egtbFile->getKey(board);
+    auto querySide = r.flipSide ? getXSide(rec.side) : rec.side;
+
+    // missing side is queried via its children, too many to prefetch
+    if (!rec.egtbFile->header->isSide(querySide)) {
+        return false;
+    }
+
+    rec.key = r.key;
+    rec.side = querySide;
+    return true;
+}
+
+void EgtbDb::prefetch(const EgtbBoardCore& board) {
+    EgtbPrefetchRec rec;
+    if (!createPrefetchRec(rec, board)) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> thelock(prefetchMtx);
+    if (!prefetchThread.joinable()) {
+        prefetchStop = false;
+        prefetchThread = std::thread(&EgtbDb::prefetchLoop, this);
+    }
+    if (prefetchQueue.size() < EGTB_PREFETCH_QUEUE_SIZE) {
+        prefetchQueue.push_back(rec);
+        prefetchCv.notify_one();
+    }
+}
+
+void EgtbDb::prefetch(const std::vector<EgtbBoard>& boards) {
+    std::vector<EgtbPrefetchRec> vec;
+    for (auto && board : boards) {
+        EgtbPrefetchRec rec;
+        if (createPrefetchRec(rec, board)) {
+            vec.push_back(rec);
+        }
+    }
+
+    if (vec.empty()) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> thelock(prefetchMtx);
+    if (!prefetchThread.joinable()) {
+        prefetchStop = false;
+        prefetchThread = std::thread(&EgtbDb::prefetchLoop, this);
+    }
+    for (auto && rec : vec) {
+        if (prefetchQueue.size() >= EGTB_PREFETCH_QUEUE_SIZE) {
+            break;
+        }
+        prefetchQueue.push_back(rec);
+    }
+    prefetchCv.notify_one();
+}
+
+void EgtbDb::prefetchLoop() {
+    // blocks are read in batches, all reads of a batch are submitted to the storage at once
+    EgtbIoRing ioRing;
+    const int blockBufSz = EGTB_SIZE_COMPRESS_BLOCK_MAX * 3 / 2;
+    std::vector<char> bufs(EGTB_IO_RING_DEPTH * blockBufSz);
+    std::vector<EgtbPrefetchRec> recs;
+    std::vector<EgtbIoRequest> requests;
+
+    while (true) {
+        recs.clear();
+        {
+            std::unique_lock<std::mutex> thelock(prefetchMtx);
+            prefetchCv.wait(thelock, [this] { return prefetchStop || !prefetchQueue.empty(); });
+            if (prefetchStop) {
+                return;
+            }
+            while (!prefetchQueue.empty() && recs.size() < EGTB_IO_RING_DEPTH) {
+                recs.push_back(prefetchQueue.front());
+                prefetchQueue.pop_front();
+            }
+        }
+
+        requests.clear();
+        for (auto && rec : recs) {
+            rec.egtbFile->checkToLoadHeaderAndTable();
+
+            if (rec.key < 0 && rec.egtbFile->loadStatus == EgtbLoadStatus::loaded) {
+                EgtbBoard board;
+                board.pieceList_setupBoard((const Piece*)rec.pieceList);
+                setPrefetchKey(rec, board);
+            }
+
+            EgtbIoRequest request;
+            if (rec.key >= 0 && rec.egtbFile->loadStatus == EgtbLoadStatus::loaded
+                && rec.egtbFile->prepareBlockRead(rec.key, rec.side, request)) {
+                request.buf = bufs.data() + requests.size() * blockBufSz;
+                requests.push_back(request);
+            } else {
+                rec.key = -1;
+            }
+        }
+
+        if (requests.empty()) {
+            continue;
+        }
+
+        ioRing.read(requests.data(), (int)requests.size());
+
+        int k = 0;
+        for (auto && rec : recs) {
+            if (rec.key >= 0) {
+                rec.egtbFile->completeBlockRead(rec.key, rec.side, requests[k++]);
+            }
+        }
+    }
+}
+
+void EgtbDb::stopPrefetch() {
+    {
+        std::lock_guard<std::mutex> thelock(prefetchMtx);
+        prefetchStop = true;
+        prefetchQueue.clear();
+        prefetchCv.notify_all();
+    }
+
+    if (prefetchThread.joinable()) {
+        prefetchThread.join();
+    }
+}
+
 EgtbFile* EgtbDb::getEgtbFile(const EgtbBoardCore& board) const {
     auto name = EgtbFile::pieceListToName((const Piece* )board.pieceList);
     return nameMap.find(name) != nameMap.end() ? nameMap.at(name) : nullptr;
@@ -201,6 +550,9 @@ int EgtbDb::probe(EgtbBoardCore& board, MoveList& moveList) {
     MoveList mList;
     board.gen(mList, side, false);
 
+    EgtbProbeContext context;
+    bool hasContext = setupProbeContext(context, board);
+
     for(int i = 0; i < mList.end && cont; i++) {
         auto move = mList.list[i];
         Hist hist;
@@ -208,8 +560,8 @@ int EgtbDb::probe(EgtbBoardCore& board, MoveList& moveList) {
         board.side = xside;
 
         if (!board.isIncheck(side)) {
-
-            int score = getScore(board);
+            auto child = context;
+            int score = hasContext && updateProbeContext(child, board, hist) ? getScore(child, board, xside) : getScore(board);
 
             if (score == EGTB_SCORE_MISSING) {
                 if (!hist.cap.isEmpty() && board.pieceList_isDraw()) {
@@ -27,19 +27,55 @@
 
 #include <vector>
 #include <map>
+#include <set>
 #include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
 
 #include "Egtb.h"
 #include "EgtbFile.h"
 #include "EgtbBoard.h"
 
+#define EGTB_PREFETCH_QUEUE_SIZE    4096
+
 namespace egtb {
 
+    class EgtbPrefetchRec {
+    public:
+        EgtbFile* egtbFile;
+        i64 key;        // negative if the file is not loaded yet, computed from pieces after loading
+        Side side;
+        Piece pieceList[2][16];
+    };
+
+    // An endgame and the key of a position in it. Children of the position after quiet moves are in the same
+    // endgame. Their keys are updated from the context (only moves of kings need whole keys computed again)
+    class EgtbProbeContext {
+    public:
+        EgtbFile*       egtbFile;
+        EgtbKeyState    keyState;
+    };
+
     class EgtbDb {
     protected:
         std::vector<std::string> folders;
+        std::set<std::string> preloadedFolders; // folders registered already, not again by later preloadings
         std::map<std::string, EgtbFile*> nameMap;
 
+        std::deque<EgtbPrefetchRec> prefetchQueue;
+        std::thread prefetchThread;
+        std::mutex prefetchMtx;
+        std::condition_variable prefetchCv;
+        bool prefetchStop;
+
+        std::shared_future<void> preloadFuture;
+
+        std::string imageFolder;
+
     public:
         std::vector<EgtbFile*> egtbFileVec;
 
@@ -50,6 +86,10 @@ namespace egtb {
         // Call it to release memory
         void removeAllBuffers();
 
+        // Budget (in bytes) of the decompressed block cache shared by all endgames not fully in memory
+        void setCacheSize(i64 sz);
+        i64  getCacheSize() const;
+
         int getSize() const {
             return (int)egtbFileVec.size();
         }
@@ -58,14 +98,42 @@ namespace egtb {
         void setFolders(const std::vector<std::string>& folders);
         void addFolders(const std::string& folderName);
 
+        // Write a catalog (egtb.cat) of all endgames of the folder. Later preloadings read it instead of
+        // scanning the folder and opening files. Recreate it whenever files are changed
+        static bool createCatalog(const std::string& folder);
+
+        // Compressed endgames loaded in mode all are decompressed once into that folder (must exist), later
+        // loadings map those images instead of decompressing again. Call it before preloading
+        void setImageFolder(const std::string& folder) { imageFolder = folder; }
+
         void preload(EgtbMemMode egtbMemMode = EgtbMemMode::tiny, EgtbLoadMode loadMode = EgtbLoadMode::onrequest);
         void preload(const std::string& folder, EgtbMemMode egtbMemMode, EgtbLoadMode loadMode = EgtbLoadMode::onrequest);
 
+        // Load all files of the folders by threadCnt threads (0 for all cores) in background. Endgames can be probed
+        // immediately, ones not loaded yet are loaded on request. The callback (if any) is called by the loading
+        // threads whenever an endgame is done (check its loadStatus). The future is ready when all have been done
+        std::shared_future<void> preloadParallel(EgtbMemMode egtbMemMode, int threadCnt = 0, std::function<void(EgtbFile*)> callback = nullptr);
+
         // Scores
         int getScore(EgtbBoardCore& board, Side side);
         int getScore(EgtbBoardCore& board);
         int getScore(const std::vector<Piece> pieceVec, Side side);
 
+        // Win / draw / loss (EGTB_WDL_WIN, EGTB_WDL_DRAW, EGTB_WDL_LOSS) for the side to move, probed from
+        // WDL tables in memory. Endgames without those tables are probed from DTM data.
+        // Positions not in any endgame are EGTB_SCORE_MISSING, cells which are not win / draw / loss (e.g. illegal)
+        // are EGTB_SCORE_UNKNOWN with both ways, WDL tables can't tell them apart
+        int getWdl(EgtbBoardCore& board, Side side);
+        int getWdl(EgtbBoardCore& board);
+
+        // Create WDL tables (.wdl) next to all DTM files of the folder
+        static bool createWdlFiles(const std::string& folder);
+
+        // Load data of positions in background, thus later queries of them won't wait for the storage.
+        // They are hints only: requests are dropped when the queue is full
+        void prefetch(const EgtbBoardCore& board);
+        void prefetch(const std::vector<EgtbBoard>& boards);
+
         // Probe (for getting the line of moves to win
         int probe(EgtbBoardCore& board, MoveList& moveList);
         int probe(const std::vector<Piece> pieceVec, Side side, MoveList& moveList);
@@ -79,8 +147,20 @@ namespace egtb {
 
     private:
         void addEgtbFile(EgtbFile *egtbFile);
+        void preloadFile(const std::string& path, EgtbMemMode egtbMemMode, EgtbLoadMode loadMode, const EgtbCatalogRec* catalogRec);
+
+        bool createPrefetchRec(EgtbPrefetchRec& rec, const EgtbBoardCore& board) const;
+        static bool setPrefetchKey(EgtbPrefetchRec& rec, const EgtbBoardCore& board);
+        void prefetchLoop();
+        void stopPrefetch();
+
+        bool setupProbeContext(EgtbProbeContext& context, const EgtbBoardCore& board) const;
+        bool updateProbeContext(EgtbProbeContext& context, const EgtbBoardCore& board, const Hist& hist) const;
 
-        int getScoreOnePly(EgtbBoardCore& board, Side side);
+        int getScore(const EgtbProbeContext& context, EgtbBoardCore& board, Side side);
+        int getScoreOnePly(const EgtbProbeContext& context, EgtbBoardCore& board, Side side);
+        int getWdl(const EgtbProbeContext& context, EgtbBoardCore& board, Side side);
+        int getWdlOnePly(const EgtbProbeContext& context, EgtbBoardCore& board, Side side);
 
     };
 
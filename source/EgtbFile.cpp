@@ -25,6 +25,9 @@
 #include <fstream>
 #include <iomanip>
 #include <ctime>
+#include <chrono>
+#include <atomic>
+#include <cstdio>
 
 #include "Egtb.h"
 #include "EgtbFile.h"
@@ -33,7 +36,6 @@
 using namespace egtb;
 
 extern int subppp_sizes[7];
-extern int *kk_2, *kk_8;
 
 //////////////////////////////////////////////////////////////////////
 
@@ -51,6 +53,11 @@ extern int *kk_2, *kk_8;
 #define TB_SPECIAL_START_MATING (TB_SPECIAL_DRAW + 1)
 #define TB_SPECIAL_START_LOSING 128
 
+#define TB_WDL_DRAW             0
+#define TB_WDL_WIN              1
+#define TB_WDL_LOSS             2
+#define TB_WDL_UNKNOWN          3   // illegal, unknown, missing
+
 //////////////////////////////////////////////////////////////////////
 
 const char* egtbFileExtensions[] = {
@@ -70,12 +77,24 @@ bool EgtbFile::knownExtension(const std::string& path) {
 //////////////////////////////////////////////////////////////////////
 // Construction/Destruction
 //////////////////////////////////////////////////////////////////////
+static std::atomic<u32> fileIdCounter(0);
+
 EgtbFile::EgtbFile() {
-    pBuf[0] = pBuf[1] = pCompressBuf = nullptr;
-    compressBlockTables[0] = compressBlockTables[1] = nullptr;
+    fileId = ++fileIdCounter;
+    pBuf[0] = pBuf[1] = nullptr;
+    fileHandles[0] = fileHandles[1] = EGTB_INVALID_FILE;
+    pMap[0] = pMap[1] = nullptr;
+    pCompressBuf[0] = pCompressBuf[1] = nullptr;
+    pWdl[0] = pWdl[1] = nullptr;
+    catalogFileSize[0] = catalogFileSize[1] = 0;
+    catalogMtime[0] = catalogMtime[1] = 0;
+    catalogBlockCnt[0] = catalogBlockCnt[1] = 0;
+    catalogTableOffset[0] = catalogTableOffset[1] = 0;
+    mapSize[0] = mapSize[1] = 0;
     header = nullptr;
     memMode = EgtbMemMode::tiny;
     loadStatus = EgtbLoadStatus::none;
+    blockSize = pageSize = EGTB_SIZE_COMPRESS_BLOCK;
     reset();
 }
 
@@ -97,18 +116,32 @@ void EgtbFile::reset() {
 };
 
 void EgtbFile::removeBuffers() {
-    if (pCompressBuf) free(pCompressBuf);
-    pCompressBuf = nullptr;
-
     for (int i = 0; i < 2; i++) {
-        if (pBuf[i]) {
-            free(pBuf[i]);
-            pBuf[i] = nullptr;
+        closeFile(fileHandles[i]);
+        fileHandles[i] = EGTB_INVALID_FILE;
+
+        if (pMap[i]) {
+            // pBuf or block table points inside the mapping
+            unmapFile(pMap[i], mapSize[i]);
+            pMap[i] = nullptr;
+            mapSize[i] = 0;
+        } else {
+            if (pBuf[i]) {
+                free(pBuf[i]);
+            }
         }
+        pBuf[i] = nullptr;
+        compressBlockTables[i].reset();
+        packedCells[i].reset();
 
-        if (compressBlockTables[i]) {
-            free(compressBlockTables[i]);
-            compressBlockTables[i] = nullptr;
+        if (pCompressBuf[i]) {
+            free(pCompressBuf[i]);
+            pCompressBuf[i] = nullptr;
+        }
+
+        if (pWdl[i]) {
+            free(pWdl[i]);
+            pWdl[i] = nullptr;
         }
 
         startpos[i] = endpos[i] = 0;
@@ -130,13 +163,50 @@ void EgtbFile::merge(EgtbFile& otherEgtbFile)
         }
 
         if (otherEgtbFile.header->isSide(side)) {
+            if (otherEgtbFile.blockSize != blockSize) {
+                std::cerr << "Error: block sizes of sides are different " << otherEgtbFile.getPath(sd) << std::endl;
+                continue;
+            }
             header->addSide(side);
             setPath(otherEgtbFile.getPath(sd), sd);
 
-            if (compressBlockTables[sd]) {
-                free(compressBlockTables[sd]);
+            compressBlockTables[sd].moveFrom(otherEgtbFile.compressBlockTables[sd]);
+
+            closeFile(fileHandles[sd]);
+            fileHandles[sd] = otherEgtbFile.fileHandles[sd];
+            otherEgtbFile.fileHandles[sd] = EGTB_INVALID_FILE;
+
+            catalogFileSize[sd] = otherEgtbFile.catalogFileSize[sd];
+            catalogMtime[sd] = otherEgtbFile.catalogMtime[sd];
+            catalogBlockCnt[sd] = otherEgtbFile.catalogBlockCnt[sd];
+            catalogTableOffset[sd] = otherEgtbFile.catalogTableOffset[sd];
+
+            if (otherEgtbFile.pCompressBuf[sd] != nullptr) {
+                if (pCompressBuf[sd]) {
+                    free(pCompressBuf[sd]);
+                }
+                pCompressBuf[sd] = otherEgtbFile.pCompressBuf[sd];
+                otherEgtbFile.pCompressBuf[sd] = nullptr;
+            }
+
+            if (otherEgtbFile.pMap[sd] != nullptr) {
+                assert(pMap[sd] == nullptr);
+                pMap[sd] = otherEgtbFile.pMap[sd];
+                mapSize[sd] = otherEgtbFile.mapSize[sd];
+                otherEgtbFile.pMap[sd] = nullptr;
+            }
+
+            if (otherEgtbFile.pWdl[sd] != nullptr) {
+                if (pWdl[sd]) {
+                    free(pWdl[sd]);
+                }
+                pWdl[sd] = otherEgtbFile.pWdl[sd];
+                otherEgtbFile.pWdl[sd] = nullptr;
+            }
+
+            if (!otherEgtbFile.packedCells[sd].isEmpty()) {
+                packedCells[sd].moveFrom(otherEgtbFile.packedCells[sd]);
             }
-            compressBlockTables[sd] = otherEgtbFile.compressBlockTables[sd];
 
             if (pBuf[sd] == nullptr && otherEgtbFile.pBuf[sd] != nullptr) {
                 pBuf[sd] = otherEgtbFile.pBuf[sd];
@@ -146,7 +216,6 @@ void EgtbFile::merge(EgtbFile& otherEgtbFile)
                 otherEgtbFile.pBuf[sd] = nullptr;
                 otherEgtbFile.startpos[sd] = 0;
                 otherEgtbFile.endpos[sd] = 0;
-                otherEgtbFile.compressBlockTables[sd] = nullptr;
             }
         }
     }
@@ -171,15 +240,41 @@ bool EgtbFile::createBuf(i64 len, int sd) {
 //////////////////////////////////////////////////////////////////////
 // Preload files
 //////////////////////////////////////////////////////////////////////
-bool EgtbFile::preload(const std::string& path, EgtbMemMode _memMode, EgtbLoadMode _loadMode) {
+bool EgtbFile::preload(const std::string& path, EgtbMemMode _memMode, EgtbLoadMode _loadMode, const EgtbCatalogRec* catalogRec) {
     if (_memMode == EgtbMemMode::smart) {
-        _memMode = getSize() < EGTB_SMART_MODE_THRESHOLD ? EgtbMemMode::all : EgtbMemMode::tiny;
+        auto sz = catalogRec ? catalogRec->size : getSize();
+        _memMode = sz < EGTB_SMART_MODE_THRESHOLD ? EgtbMemMode::all : EgtbMemMode::tiny;
     }
 
     memMode = _memMode;
     loadMode = _loadMode;
 
     loadStatus = EgtbLoadStatus::none;
+
+    if (catalogRec) {
+        int sd = catalogRec->side;
+        catalogFileSize[sd] = catalogRec->fileSize;
+        catalogMtime[sd] = catalogRec->mtime;
+        catalogBlockCnt[sd] = catalogRec->blockCnt;
+        catalogTableOffset[sd] = catalogRec->blockTableOffset;
+
+        // the catalog has the header, no need to open the file now
+        if (loadMode == EgtbLoadMode::onrequest) {
+            header = new EgtbFileHeader();
+            memcpy(header, catalogRec->header, EGTB_HEADER_SIZE);
+            if (!header->isValid()) {
+                return false;
+            }
+            header->setOnlySide(static_cast<Side>(sd));
+            egtbName = header->name;
+            blockSize = header->getBlockSize();
+            pageSize = MIN(blockSize, EGTB_SIZE_CACHE_PAGE);
+            setPath(path, sd);
+            setupIdxComputing(getName(), header->order, header->getVersion());
+            return true;
+        }
+    }
+
     if (loadMode == EgtbLoadMode::onrequest) {
         auto theName = getFileName(path);
         if (theName.length() < 4) {
@@ -208,60 +303,112 @@ bool EgtbFile::loadHeaderAndTable(const std::string& path) {
 
     // if there are files for both sides, header has been created already
     auto oldSide = Side::none;
-    if (header == nullptr) {
-        header = new EgtbFileHeader();
-    } else {
+    if (header != nullptr) {
         oldSide = header->isSide(Side::black) ? Side::black : Side::white;
     }
     auto loadingSide = Side::none;
 
-    bool r = false;
-    if (file && header->readFile(file) && header->isValid()) {
-        loadingSide = header->isSide(Side::white) ? Side::white : Side::black;
+    // the header is read aside, a rejected file changes neither the header nor paths of the other side
+    EgtbFileHeader fileHeader;
+    bool r = file && fileHeader.readFile(file) && fileHeader.isValid();
+    if (r) {
+        loadingSide = fileHeader.isSide(Side::white) ? Side::white : Side::black;
         assert(loadingSide == (path.find("w.") != std::string::npos ? Side::white : Side::black));
-        egtbName = header->name;
+
+        // both sides must have the same block size
+        if (oldSide != Side::none && fileHeader.getBlockSize() != blockSize) {
+            if (egtbVerbose) {
+                std::cerr << "Error: block sizes of sides are different " << path << std::endl;
+            }
+            r = false;
+        }
+    }
+
+    if (r) {
+        if (header == nullptr) {
+            header = new EgtbFileHeader();
+        }
+        *header = fileHeader;
+        if (egtbName != header->name) {
+            egtbName = header->name;    // set already when registered on request
+        }
 
         setPath(path, static_cast<int>(loadingSide));
         header->setOnlySide(loadingSide);
-        assert(loadingSide == (path.find("w.") != std::string::npos ? Side::white : Side::black));
-        r = loadingSide != Side::none;
 
-        if (r) {
-            setupIdxComputing(getName(), header->order, header->getVersion());
+        blockSize = header->getBlockSize();
+        pageSize = MIN(blockSize, EGTB_SIZE_CACHE_PAGE);
+        setupIdxComputing(getName(), header->order, header->getVersion());
 
-            if (oldSide != Side::none) {
-                header->addSide(oldSide);
-            }
+        if (oldSide != Side::none) {
+            header->addSide(oldSide);
+        }
+    }
+
+    // no side without a valid header
+    if (!r) {
+        if (egtbVerbose) {
+            std::cerr << "Error: cannot read " << path << std::endl;
         }
+        return false;
     }
 
     auto sd = static_cast<int>(loadingSide);
     startpos[sd] = endpos[sd] = 0;
 
-    if (r && isCompressed()) {
-        // Create & read compress block table
-        auto blockCnt = getCompresseBlockCount();
-        int blockTableSz = blockCnt * sizeof(u32);
+    if (catalogMtime[sd] != 0) {
+        i64 fileSize, mtime;
+        auto blockCnt = isCompressed() ? getCompresseBlockCount() : 0;
+        auto tableOffset = isCompressed() ? EGTB_HEADER_SIZE : 0;
+        if (!getFileStat(path, fileSize, mtime) || fileSize != catalogFileSize[sd] || mtime != catalogMtime[sd]
+            || blockCnt != catalogBlockCnt[sd] || tableOffset != catalogTableOffset[sd]) {
+            // the catalog may have registered it wrongly (name, order, side), the file can't be trusted
+            if (egtbVerbose) {
+                std::cerr << "Error: file has been changed after creating the catalog, please recreate it: " << path << std::endl;
+            }
+            r = false;
+        }
+    }
 
-        compressBlockTables[sd] = (u32*) malloc(blockTableSz + 64);
+    // mapped mode uses the block table straight from the mapping
+    if (r && isCompressed() && memMode != EgtbMemMode::mapped) {
+        // Create & read compress block table
+        compressBlockTables[sd].init(getCompresseBlockCount(), header->isWideBlockTable());
 
-        if (!file.read((char *)compressBlockTables[sd], blockTableSz)) {
+        if (!compressBlockTables[sd].read(file)) {
             if (egtbVerbose) {
                 std::cerr << "Error: cannot read " << path << std::endl;
             }
             file.close();
-            free(compressBlockTables[sd]);
-            compressBlockTables[sd] = nullptr;
             return false;
         }
 
+        // the table is kept for probing, modes all and packed release it after loading
+        if (!isAllDataMode()) {
+            compressBlockTables[sd].compact();
+        }
+
     }
 
-    if (r && memMode == EgtbMemMode::all) {
-        r = loadAllData(file, loadingSide);
+    if (r) {
+        if (isAllDataMode() || (memMode == EgtbMemMode::compressed && !isCompressed())) {
+            r = loadAllData(file, loadingSide);
+        } else if (memMode == EgtbMemMode::compressed) {
+            r = loadCompressedData(file, loadingSide);
+        } else if (memMode == EgtbMemMode::mapped) {
+            r = mapAllData(path, loadingSide);
+        } else {
+            closeFile(fileHandles[sd]);
+            fileHandles[sd] = openFileForRead(path);
+            r = fileHandles[sd] != EGTB_INVALID_FILE;
+        }
     }
     file.close();
 
+    if (r) {
+        loadWdl(loadingSide);
+    }
+
 
     if (!r && egtbVerbose) {
         std::cerr << "Error: cannot read " << path << std::endl;
@@ -274,29 +421,47 @@ bool EgtbFile::loadAllData(std::ifstream& file, Side side) {
 
     auto sd = static_cast<int>(side);
     startpos[sd] = endpos[sd] = 0;
+    i64 loadedSz = 0;   // the range is published at the end
 
     if (isCompressed()) {
-        auto blockCnt = getCompresseBlockCount();
-        int blockTableSz = blockCnt * sizeof(u32);
+        // the decompressed image is made once and mapped by later loadings
+        EgtbFileHeader imageHeader;
+        bool useImage = !imageFolder.empty();
+        if (useImage) {
+            file.seekg(0, std::ios::beg);
+            useImage = imageHeader.readFile(file);
+            imageHeader.property &= ~EGTB_PROP_COMPRESSED;
+
+            if (useImage && mapImage(imageHeader, side)) {
+                compressBlockTables[sd].reset();
+                loadedSz = getSize();
+            }
+        }
 
-        i64 seekpos = EGTB_HEADER_SIZE + blockTableSz;
-        file.seekg(seekpos, std::ios::beg);
+        if (loadedSz == 0) {
+            auto& blockTable = compressBlockTables[sd];
+            i64 seekpos = EGTB_HEADER_SIZE + blockTable.getTableSize();
+            file.seekg(seekpos, std::ios::beg);
 
-        createBuf(getSize(), sd); assert(pBuf[sd]);
+            createBuf(getSize(), sd); assert(pBuf[sd]);
 
-        auto compDataSz = compressBlockTables[sd][blockCnt - 1] & ~EGTB_UNCOMPRESS_BIT;
+            auto compDataSz = blockTable.getDataSize();
 
-        char* tempBuf = (char*) malloc(compDataSz + 64);
-        if (file.read(tempBuf, compDataSz)) {
-            auto originSz = decompressAllBlocks(EGTB_SIZE_COMPRESS_BLOCK, blockCnt, compressBlockTables[sd], (char*)pBuf[sd], getSize(), tempBuf, compDataSz);
-            assert(originSz == getSize());
+            char* tempBuf = (char*) malloc(compDataSz + 64);
+            if (file.read(tempBuf, compDataSz)) {
+                auto originSz = decompressAllBlocks(blockSize, blockTable, (char*)pBuf[sd], getSize(), tempBuf, compDataSz);
+                assert(originSz == getSize());
 
-            endpos[sd] = originSz;
-        }
+                loadedSz = MAX(originSz, (i64)0);
+            }
+
+            free(tempBuf);
+            blockTable.reset();
 
-        free(tempBuf);
-        free(compressBlockTables[sd]);
-        compressBlockTables[sd] = nullptr;
+            if (useImage && loadedSz == getSize()) {
+                saveImage(imageHeader, side);
+            }
+        }
     } else {
         auto sz = getSize();
         createBuf(sz, sd);
@@ -304,20 +469,160 @@ bool EgtbFile::loadAllData(std::ifstream& file, Side side) {
         file.seekg(seekpos, std::ios::beg);
 
         if (file.read(pBuf[sd], sz)) {
-            endpos[sd] = sz;
+            loadedSz = sz;
+        }
+    }
+
+    if (loadedSz <= 0) {
+        return false;
+    }
+
+    // Mode packed: pack the cells before the range is published, probing threads read pBuf without locks
+    // thus it must never be released once they may see it
+    if (memMode == EgtbMemMode::packed && loadedSz == getSize() && packedCells[sd].pack(pBuf[sd], getSize())) {
+        releaseBuf(sd);
+        return true;
+    }
+
+    std::atomic_thread_fence(std::memory_order_release);
+    endpos[sd] = loadedSz;
+    return true;
+}
+
+// The loaded bytes of a side (allocated or mapped), never published
+void EgtbFile::releaseBuf(int sd) {
+    if (pMap[sd]) {
+        unmapFile(pMap[sd], mapSize[sd]);
+        pMap[sd] = nullptr;
+        mapSize[sd] = 0;
+    } else {
+        free(pBuf[sd]);
+    }
+    pBuf[sd] = nullptr;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Decompressed images of compressed files (mode all). They are uncompressed files,
+// their headers are the ones of the compressed files except the compressed property
+//////////////////////////////////////////////////////////////////////
+std::string EgtbFile::getImagePath(int sd) const {
+    return imageFolder + "/" + getFileName(getPath(sd)) + ".mtb";
+}
+
+bool EgtbFile::mapImage(const EgtbFileHeader& imageHeader, Side side) {
+    auto sd = static_cast<int>(side);
+    assert(pMap[sd] == nullptr && pBuf[sd] == nullptr);
+
+    i64 sz;
+    auto data = mapFile(getImagePath(sd), sz);
+    if (data == nullptr) {
+        return false;
+    }
+
+    // stale image, made from another file
+    if (sz != EGTB_HEADER_SIZE + getSize() || memcmp(data, &imageHeader, EGTB_HEADER_SIZE) != 0) {
+        unmapFile(data, sz);
+        return false;
+    }
+
+    pMap[sd] = data;
+    mapSize[sd] = sz;
+    pBuf[sd] = (char*)data + EGTB_HEADER_SIZE;
+    return true;
+}
+
+bool EgtbFile::saveImage(const EgtbFileHeader& imageHeader, Side side) const {
+    auto sd = static_cast<int>(side);
+    auto imagePath = getImagePath(sd);
+
+    // write a temporary file then rename it, other processes may be loading the image
+    auto tmpPath = imagePath + ".tmp" + std::to_string(fileId) + "_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+
+    std::ofstream outfile(tmpPath, std::ios::binary);
+    bool r = outfile && imageHeader.saveFile(outfile) && outfile.write(pBuf[sd], getSize());
+    outfile.close();
+
+    if (r) {
+        std::remove(imagePath.c_str());
+        r = std::rename(tmpPath.c_str(), imagePath.c_str()) == 0;
+    }
+
+    if (!r) {
+        std::remove(tmpPath.c_str());
+        if (egtbVerbose) {
+            std::cerr << "Error: cannot write " << imagePath << std::endl;
         }
     }
+    return r;
+}
+
+// Load compressed data (file is at the end of the block table), blocks are decompressed from it when needed
+bool EgtbFile::loadCompressedData(std::ifstream& file, Side side) {
+    auto sd = static_cast<int>(side);
+    assert(isCompressed() && !compressBlockTables[sd].isEmpty() && pCompressBuf[sd] == nullptr);
+
+    auto compDataSz = compressBlockTables[sd].getDataSize();
 
-    return startpos[sd] < endpos[sd];
+    pCompressBuf[sd] = (char*) malloc(compDataSz + 64);
+    if (!file.read(pCompressBuf[sd], compDataSz)) {
+        free(pCompressBuf[sd]);
+        pCompressBuf[sd] = nullptr;
+        return false;
+    }
+    return true;
+}
+
+// Map the whole file. Cells of uncompressed files are read straight from the mapping,
+// blocks of compressed ones are decompressed from it
+bool EgtbFile::mapAllData(const std::string& path, Side side) {
+    auto sd = static_cast<int>(side);
+    assert(pMap[sd] == nullptr && compressBlockTables[sd].isEmpty());
+
+    startpos[sd] = endpos[sd] = 0;
+
+    i64 sz;
+    auto data = mapFile(path, sz);
+    if (data == nullptr) {
+        return false;
+    }
+
+    if (isCompressed()) {
+        auto& blockTable = compressBlockTables[sd];
+        blockTable.init(getCompresseBlockCount(), header->isWideBlockTable());
+        if (sz < EGTB_HEADER_SIZE + blockTable.getTableSize()) {
+            unmapFile(data, sz);
+            return false;
+        }
+        blockTable.attach(data + EGTB_HEADER_SIZE);
+        if (sz < EGTB_HEADER_SIZE + blockTable.getTableSize() + blockTable.getDataSize()) {
+            blockTable.reset();
+            unmapFile(data, sz);
+            return false;
+        }
+        pMap[sd] = data;
+        mapSize[sd] = sz;
+        return true;
+    }
+
+    if (sz < EGTB_HEADER_SIZE + getSize()) {
+        unmapFile(data, sz);
+        return false;
+    }
+
+    pMap[sd] = data;
+    mapSize[sd] = sz;
+    pBuf[sd] = (char*)data + EGTB_HEADER_SIZE;
+    endpos[sd] = getSize();
+    return true;
 }
 
 void EgtbFile::checkToLoadHeaderAndTable() {
-    if (header != nullptr && loadStatus != EgtbLoadStatus::none) {
+    if (loadStatus != EgtbLoadStatus::none && header != nullptr) {
         return;
     }
 
     std::lock_guard<std::mutex> thelock(mtx);
-    if (header != nullptr && loadStatus != EgtbLoadStatus::none) {
+    if (loadStatus != EgtbLoadStatus::none && header != nullptr) {
         return;
     }
 
@@ -332,35 +637,15 @@ void EgtbFile::checkToLoadHeaderAndTable() {
     loadStatus = r ? EgtbLoadStatus::loaded : EgtbLoadStatus::error;
 }
 
-bool EgtbFile::readBuf(i64 idx, int sd)
+bool EgtbFile::readBuf(int sd)
 {
-    if (!pBuf[sd]) {
-        createBuf(getBufSize(), sd);
-    }
-
-    auto bufCnt = MIN(getBufItemCnt(), getSize() - idx);
-    auto bufsz = bufCnt;
+    assert(isAllDataMode());
 
     bool r = false;
     std::ifstream file(getPath(sd), std::ios::binary);
     if (file) {
-        if (memMode == EgtbMemMode::all) {
-            Side side = static_cast<Side>(sd);
-            r = loadAllData(file, side);
-        } else if (isCompressed() && compressBlockTables[sd]) {
-            r = readCompressedBlock(file, idx, sd, (char*)pBuf[sd]);
-        } else {
-            auto beginIdx = (idx + bufCnt <= getSize()) ? idx : 0;
-            auto x = beginIdx;
-            i64 seekpos = EGTB_HEADER_SIZE + x;
-            file.seekg(seekpos, std::ios::beg);
-
-            if (file.read(pBuf[sd], bufsz)) {
-                startpos[sd] = beginIdx;
-                endpos[sd] = beginIdx + bufCnt;
-                r = true;
-            }
-        }
+        Side side = static_cast<Side>(sd);
+        r = loadAllData(file, side);
     }
 
     file.close();
@@ -372,42 +657,96 @@ bool EgtbFile::readBuf(i64 idx, int sd)
     return r;
 }
 
-bool EgtbFile::readCompressedBlock(std::ifstream& file, i64 idx, int sd, char* pDest)
+// Where the data of the block containing idx is in the file: its offset, size and if it is compressed
+bool EgtbFile::getBlockPos(i64 idx, int sd, i64& seekpos, int& dataSz, bool& iscompressed) const
 {
-    auto blockCnt = getCompresseBlockCount();
-    int blockTableSz = blockCnt * sizeof(u32);
-
-    const int blockSize = EGTB_SIZE_COMPRESS_BLOCK;
     auto blockIdx = idx / blockSize;
-    startpos[sd] = endpos[sd] = blockIdx * blockSize;
 
-    auto iscompressed = !(compressBlockTables[sd][blockIdx] & EGTB_UNCOMPRESS_BIT);
-    auto blockOffset = blockIdx == 0 ? 0 : (compressBlockTables[sd][blockIdx - 1] & ~EGTB_UNCOMPRESS_BIT);
+    if (!isCompressed()) {
+        seekpos = EGTB_HEADER_SIZE + blockIdx * blockSize;
+        dataSz = (int)MIN((i64)blockSize, getSize() - blockIdx * blockSize);
+        iscompressed = false;
+        return true;
+    }
+
+    auto& blockTable = compressBlockTables[sd];
+    assert(!blockTable.isEmpty());
+
+    i64 blockOffset, sz;
+    blockTable.getBlock(blockIdx, blockOffset, sz, iscompressed);
 
-    auto compDataSz = (compressBlockTables[sd][blockIdx] & ~EGTB_UNCOMPRESS_BIT) - blockOffset;
+    dataSz = (int)sz;
+    seekpos = EGTB_HEADER_SIZE + blockTable.getTableSize() + blockOffset;
 
-    i64 seekpos = EGTB_HEADER_SIZE + blockTableSz + blockOffset;
-    file.seekg(seekpos, std::ios::beg);
+    return sz >= 0 && sz <= (iscompressed ? blockSize * 3 / 2 : blockSize);
+}
 
-    if (iscompressed) {
-        if (pCompressBuf == nullptr) {
-            pCompressBuf = (char*) malloc(EGTB_SIZE_COMPRESS_BLOCK * 3 / 2);
+// Decode the data of the block containing idx (read from getBlockPos) into pDest, return the block size or -1 if failed
+int EgtbFile::decodeBlock(i64 idx, char* pDest, const char* data, int dataSz, bool iscompressed) const
+{
+    if (!iscompressed) {
+        if (pDest != data) {
+            memcpy(pDest, data, dataSz);
         }
-        if (file.read(pCompressBuf, compDataSz)) {
-            auto curBlockSize = (int)MIN(getSize() - startpos[sd], (i64)blockSize);
-            auto originSz = decompress(pDest, curBlockSize, pCompressBuf, compDataSz);
-            endpos[sd] += originSz;
-            return true;
+        return dataSz;
+    }
+
+    auto blockIdx = idx / blockSize;
+    auto curBlockSize = (int)MIN(getSize() - blockIdx * blockSize, (i64)blockSize);
+    return decompress(pDest, curBlockSize, data, dataSz);
+}
+
+// Data of a block (from getBlockPos) if it is in memory already, otherwise read it into buf. Return nullptr if failed
+const char* EgtbFile::getBlockData(int sd, i64 seekpos, int dataSz, char* buf) const
+{
+    if (pMap[sd]) {
+        return pMap[sd] + seekpos;
+    }
+
+    if (pCompressBuf[sd]) {
+        i64 dataStart = EGTB_HEADER_SIZE + compressBlockTables[sd].getTableSize();
+        return pCompressBuf[sd] + seekpos - dataStart;
+    }
+
+    return readFileAt(fileHandles[sd], buf, dataSz, seekpos) ? buf : nullptr;
+}
+
+// Buffers for the largest blocks, one set for each thread, allocated when used
+static thread_local std::vector<char> threadBlockBuf, threadCompressBuf;
+
+static char* getThreadBlockBuf() {
+    if (threadBlockBuf.empty()) {
+        threadBlockBuf.resize(EGTB_SIZE_COMPRESS_BLOCK_MAX);
+    }
+    return threadBlockBuf.data();
+}
+
+static char* getThreadCompressBuf() {
+    if (threadCompressBuf.empty()) {
+        threadCompressBuf.resize(EGTB_SIZE_COMPRESS_BLOCK_MAX * 3 / 2);
+    }
+    return threadCompressBuf.data();
+}
+
+// Read the whole block containing idx into pDest, return the block size or -1 if failed.
+// The function does not touch any member, thus it could be called from many threads
+int EgtbFile::readBlock(i64 idx, int sd, char* pDest) const
+{
+    i64 seekpos;
+    int dataSz;
+    bool iscompressed;
+
+    if (getBlockPos(idx, sd, seekpos, dataSz, iscompressed)) {
+        auto data = getBlockData(sd, seekpos, dataSz, iscompressed ? getThreadCompressBuf() : pDest);
+        if (data) {
+            return decodeBlock(idx, pDest, data, dataSz, iscompressed);
         }
-    } else if (file.read(pDest, compDataSz)) {
-        endpos[sd] += compDataSz;
-        return true;
     }
 
     if (egtbVerbose) {
         std::cerr << "Error: cannot read " << getPath(sd) << std::endl;
     }
-    return false;
+    return -1;
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -468,14 +807,190 @@ char EgtbFile::getCell(i64 idx, Side side)
 
     int sd = static_cast<int>(side);
 
-    if (!isDataReady(idx, sd)) {
-        if (!readBuf(idx, sd)) {
+    if (!packedCells[sd].isEmpty()) {
+        return packedCells[sd].getCell(idx);
+    }
+
+    if (isDataReady(idx, sd)) {
+        return pBuf[sd][idx - startpos[sd]];
+    }
+
+    if (isAllDataMode()) {
+        if (!readBuf(sd)) {
             return TB_MISSING;
         }
+        return packedCells[sd].isEmpty() ? pBuf[sd][idx - startpos[sd]] : packedCells[sd].getCell(idx);
+    }
+
+    // tiny, mapped and compressed modes: the page of the cell may be in the thread cache or the shared one
+    auto key = getCacheKey(idx, sd);
+    char ch;
+    if (egtbBlockCache.getCell(key, (int)(idx % pageSize), ch)) {
+        return ch;
     }
 
-    char ch = pBuf[sd][idx - startpos[sd]];
-    return ch;
+    if (isCompressed() && getCellPartly(idx, sd, ch)) {
+        return ch;
+    }
+
+    auto buf = getThreadBlockBuf();
+    auto sz = readBlock(idx, sd, buf);
+    auto offset = (int)(idx % blockSize);
+    if (sz <= offset) {
+        return TB_MISSING;
+    }
+    addBlockToCache(idx, sd, buf, sz, true);
+    return buf[offset];
+}
+
+// Key of the cache page of idx
+u64 EgtbFile::getCacheKey(i64 idx, int sd) const
+{
+    return EgtbBlockCache::makeKey(fileId, sd, idx / pageSize);
+}
+
+// Add a decompressed block (the one of idx) into the block cache, page by page. Only the page of idx may go
+// to the thread cache, other ones are not probed yet
+void EgtbFile::addBlockToCache(i64 idx, int sd, const char* data, int sz, bool useThreadCache)
+{
+    auto blockStart = idx - idx % blockSize;
+    auto pageOfIdx = (int)(idx - blockStart) / pageSize;
+    for (int k = 0, offset = 0; offset < sz; k++, offset += pageSize) {
+        auto key = getCacheKey(blockStart + offset, sd);
+        egtbBlockCache.add(key, data + offset, MIN(pageSize, sz - offset), useThreadCache && k == pageOfIdx);
+    }
+}
+
+// Each thread keeps one block decoded partly
+static thread_local EgtbDecodeStream decodeStream;
+
+// Decode the compressed block of idx only up to the cell, for blocks missed the first time. A block missed
+// again is probed more: the block of the stream is decoded to its end, a given up one is read again wholly
+// by the caller (return false), then it is added to the cache. Moving to another block gives up the
+// current one at once, its rest is never decoded on the path of an unrelated probe.
+// Return false if the block could not be decoded that way
+bool EgtbFile::getCellPartly(i64 idx, int sd, char& cell)
+{
+    auto& stream = decodeStream;
+    auto blockStart = idx - idx % blockSize;
+    auto offset = (int)(idx - blockStart);
+    auto key = getCacheKey(blockStart, sd);
+
+    if (stream.key == key) {
+        bool ok = stream.decodeTo(stream.dstLen);
+        if (ok) {
+            cell = stream.dst[offset];
+            addBlockToCache(idx, sd, stream.dst, stream.decodedSz, true);
+        }
+        stream.key = 0;
+        return ok;
+    }
+
+    if (stream.isDropped(key)) {
+        return false;
+    }
+
+    i64 seekpos;
+    int dataSz;
+    bool iscompressed;
+    if (!getBlockPos(idx, sd, seekpos, dataSz, iscompressed) || !iscompressed) {
+        return false;
+    }
+
+    stream.drop();
+    auto data = getBlockData(sd, seekpos, dataSz, stream.src);
+    if (data == nullptr) {
+        return false;
+    }
+    if (data != stream.src) {
+        memcpy(stream.src, data, dataSz);
+    }
+
+    auto curBlockSize = (int)MIN(getSize() - blockStart, (i64)blockSize);
+    stream.begin(key, dataSz, curBlockSize);
+
+    if (!stream.decodeTo(offset + 1)) {
+        stream.key = 0;
+        return false;
+    }
+
+    cell = stream.dst[offset];
+    if (stream.isComplete()) {
+        addBlockToCache(idx, sd, stream.dst, stream.decodedSz, true);
+        stream.key = 0;
+    }
+    return true;
+}
+
+void EgtbFile::prefetch(i64 idx, Side side)
+{
+    EgtbIoRequest request;
+    request.buf = getThreadCompressBuf();
+    if (prepareBlockRead(idx, side, request)) {
+        request.ok = readFileAt(request.handle, request.buf, request.size, request.offset);
+        completeBlockRead(idx, side, request);
+    }
+}
+
+// Fill request (except its buffer) if the block of idx must be read from the file.
+// Blocks which could be got without reading files are handled here
+bool EgtbFile::prepareBlockRead(i64 idx, Side side, EgtbIoRequest& request)
+{
+    if (idx < 0 || idx >= getSize()) {
+        return false;
+    }
+
+    int sd = static_cast<int>(side);
+
+    if (isDataReady(idx, sd)) {
+        // touch the data, mapped pages will be read if they are not in memory
+        volatile char ch = pBuf[sd][idx - startpos[sd]];
+        (void)ch;
+        return false;
+    }
+
+    if (isAllDataMode()) {
+        return false;
+    }
+
+    if (egtbBlockCache.has(getCacheKey(idx, sd))) {
+        return false;
+    }
+
+    // data is in memory already, decompress it now
+    if (pMap[sd] || pCompressBuf[sd]) {
+        auto buf = getThreadBlockBuf();
+        auto sz = readBlock(idx, sd, buf);
+        if (sz > 0) {
+            addBlockToCache(idx, sd, buf, sz, false);
+        }
+        return false;
+    }
+
+    bool iscompressed;
+    if (!getBlockPos(idx, sd, request.offset, request.size, iscompressed)) {
+        return false;
+    }
+    request.handle = fileHandles[sd];
+    request.ok = false;
+    return true;
+}
+
+// Decode the data read for a request of prepareBlockRead and add the block into the block cache
+void EgtbFile::completeBlockRead(i64 idx, Side side, const EgtbIoRequest& request)
+{
+    if (!request.ok) {
+        return;
+    }
+
+    int sd = static_cast<int>(side);
+    auto buf = getThreadBlockBuf();
+
+    bool iscompressed = isCompressed() && compressBlockTables[sd].isBlockCompressed(idx / blockSize);
+    auto sz = decodeBlock(idx, buf, request.buf, request.size, iscompressed);
+    if (sz > 0) {
+        addBlockToCache(idx, sd, buf, sz, false);
+    }
 }
 
 char EgtbFile::getCell(const EgtbBoardCore& board, Side side) {
@@ -510,13 +1025,149 @@ int EgtbFile::getScore(i64 idx, Side side, bool useLock)
 {
     checkToLoadHeaderAndTable();
 
-    if (useLock && (memMode != EgtbMemMode::all || !isDataReady(idx, static_cast<int>(side)))) {
+    // tiny mode reads blocks into local buffers and needs no lock
+    if (useLock && isAllDataMode() && !isCellReady(idx, static_cast<int>(side))) {
         std::lock_guard<std::mutex> thelock(sdmtx[static_cast<int>(side)]);
         return getScoreNoLock(idx, side);
     }
     return getScoreNoLock(idx, side);
 }
 
+//////////////////////////////////////////////////////////////////////
+// WDL companion tables. They are uncompressed files with headers of DTM files except properties,
+// cells are 2 bits (4 cells a byte, the first one at the lowest bits)
+//////////////////////////////////////////////////////////////////////
+std::string EgtbFile::getWdlPath(int sd) const {
+    auto thePath = getPath(sd);
+    auto pos = thePath.find_last_of('.');
+    return (pos == std::string::npos ? thePath : thePath.substr(0, pos)) + ".wdl";
+}
+
+// Load the WDL table of a side if its file exists
+bool EgtbFile::loadWdl(Side side) {
+    auto sd = static_cast<int>(side);
+    std::ifstream file(getWdlPath(sd), std::ios::binary);
+    if (!file) {
+        return false;
+    }
+
+    EgtbFileHeader wdlHeader;
+    if (!wdlHeader.readFile(file) || !wdlHeader.isValid() || !(wdlHeader.property & EGTB_PROP_WDL)
+        || !wdlHeader.isSide(side) || wdlHeader.order != header->order
+        || strncmp(wdlHeader.name, header->name, sizeof(wdlHeader.name)) != 0) {
+        if (egtbVerbose) {
+            std::cerr << "Error: WDL file does not match its endgame " << getWdlPath(sd) << std::endl;
+        }
+        return false;
+    }
+
+    auto sz = (getSize() + 3) / 4;
+    auto buf = (u8*)malloc(sz);
+    if (buf == nullptr || !file.read((char*)buf, sz)) {
+        free(buf);
+        if (egtbVerbose) {
+            std::cerr << "Error: cannot read " << getWdlPath(sd) << std::endl;
+        }
+        return false;
+    }
+
+    if (pWdl[sd]) {
+        free(pWdl[sd]);
+    }
+    pWdl[sd] = buf;
+    return true;
+}
+
+// Scores which are not win / draw / loss become EGTB_SCORE_UNKNOWN, as the code of those cells in WDL tables
+int EgtbFile::scoreToWdl(int score) {
+    if (score == EGTB_SCORE_WINNING) {
+        return EGTB_WDL_WIN;
+    }
+    if (abs(score) > EGTB_SCORE_MATE) {
+        return EGTB_SCORE_UNKNOWN;
+    }
+    return score > 0 ? EGTB_WDL_WIN : score < 0 ? EGTB_WDL_LOSS : EGTB_WDL_DRAW;
+}
+
+int EgtbFile::getWdl(i64 idx, Side side) {
+    checkToLoadHeaderAndTable();
+
+    if (idx < 0 || idx >= getSize()) {
+        return EGTB_SCORE_MISSING;
+    }
+
+    auto sd = static_cast<int>(side);
+    if (pWdl[sd] == nullptr) {
+        return scoreToWdl(getScore(idx, side));
+    }
+
+    static const int wdls[] = { EGTB_WDL_DRAW, EGTB_WDL_WIN, EGTB_WDL_LOSS, EGTB_SCORE_UNKNOWN };
+    return wdls[(pWdl[sd][idx >> 2] >> ((idx & 3) * 2)) & 3];
+}
+
+bool EgtbFile::createWdlFile(Side side) {
+    checkToLoadHeaderAndTable();
+
+    auto sd = static_cast<int>(side);
+    if (loadStatus != EgtbLoadStatus::loaded || !header->isSide(side)) {
+        return false;
+    }
+
+    auto sz = getSize();
+    auto wdlSz = (sz + 3) / 4;
+    auto wdl = (u8*)malloc(wdlSz);
+    if (wdl == nullptr) {
+        return false;
+    }
+    memset(wdl, 0, wdlSz);
+
+    bool r = true;
+    auto buf = getThreadBlockBuf();
+    for (i64 idx = 0; r && idx < sz; idx += blockSize) {
+        auto n = (int)MIN((i64)blockSize, sz - idx);
+        const char* cells = buf;
+        if (isDataReady(idx, sd) && isDataReady(idx + n - 1, sd)) {
+            cells = pBuf[sd] + idx - startpos[sd];
+        } else if (!packedCells[sd].isEmpty()) {
+            for (int i = 0; i < n; i++) {
+                buf[i] = packedCells[sd].getCell(idx + i);
+            }
+        } else {
+            r = readBlock(idx, sd, buf) == n;
+        }
+
+        for (int i = 0; r && i < n; i++) {
+            int code;
+            switch (scoreToWdl(cellToScore(cells[i]))) {
+                case EGTB_WDL_DRAW: code = TB_WDL_DRAW; break;
+                case EGTB_WDL_WIN:  code = TB_WDL_WIN; break;
+                case EGTB_WDL_LOSS: code = TB_WDL_LOSS; break;
+                default:            code = TB_WDL_UNKNOWN; break;
+            }
+            auto k = idx + i;
+            wdl[k >> 2] |= (u8)(code << ((k & 3) * 2));
+        }
+    }
+
+    if (r) {
+        EgtbFileHeader wdlHeader;
+        memcpy(&wdlHeader, header, EGTB_HEADER_SIZE);
+        wdlHeader.property &= ~EGTB_PROP_COMPRESSED;
+        wdlHeader.property |= EGTB_PROP_WDL;
+        wdlHeader.setOnlySide(side);
+
+        std::ofstream outfile(getWdlPath(sd), std::ios::binary);
+        r = outfile && wdlHeader.saveFile(outfile) && outfile.write((const char*)wdl, wdlSz);
+    }
+
+    free(wdl);
+
+    if (!r) {
+        std::cerr << "Error: cannot create " << getWdlPath(sd) << std::endl;
+    }
+    return r;
+}
+
 //////////////////////////////////////////////////////////////////////
 // Parse name
 //////////////////////////////////////////////////////////////////////
@@ -684,6 +1335,7 @@ i64 EgtbFile::parseAttr(const int* idxArr, i64* idxMult, int* pieceCount, const
 i64 EgtbFile::setupIdxComputing(const std::string& name, int order, int version)
 {
     size = EgtbFile::parseAttr(name.c_str(), idxArr, idxMult, (int*)pieceCount, order, version);
+    keyPlan.init(idxArr, idxMult, order);
     enpassantable = pieceCount[0][static_cast<int>(PieceType::pawn)] > 0 && pieceCount[1][static_cast<int>(PieceType::pawn)] > 0;
     return size;
 }
@@ -726,7 +1378,7 @@ std::string EgtbFile::pieceListToName(const Piece* pieceList) {
 
 EgtbKeyRec EgtbFile::getKey(const EgtbBoardCore& board) const {
     EgtbKeyRec rec;
-    EgtbKey::getKey(rec, board, idxArr, idxMult, header ? header->order : 0);
+    keyPlan.getKey(rec, board);
     return rec;
 }
 
@@ -799,7 +1451,7 @@ bool EgtbFile::setupBoard(EgtbBoardCore& board, i64 idx, FlipMode flip, Side fir
 
             case EGTB_IDX_KK_2:
             {
-                int kk = kk_2[key];
+                int kk = EgtbKey::getKingPair(key, true);
                 int k0 = kk >> 8, k1 = kk & 0xff;
                 board.pieceList[sd][0].type = PieceType::king;
                 board.pieceList[sd][0].side = side;
@@ -813,7 +1465,7 @@ bool EgtbFile::setupBoard(EgtbBoardCore& board, i64 idx, FlipMode flip, Side fir
 
             case EGTB_IDX_KK_8:
             {
-                int kk = kk_8[key];
+                int kk = EgtbKey::getKingPair(key, false);
                 int k0 = kk >> 8, k1 = kk & 0xff;
                 board.pieceList[sd][0].type = PieceType::king;
                 board.pieceList[sd][0].side = side;
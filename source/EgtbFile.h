@@ -26,6 +26,7 @@
 #define EgtbFile_h
 
 #include <assert.h>
+#include <atomic>
 #include <fstream>
 #include <mutex>
 
@@ -43,7 +44,8 @@ namespace egtb {
 
         u8          dtm_max;
         u8          notused0;
-        u8          notused[10];
+        u8          blockSizeShift;     // V1, V2
+        u8          notused[9];
 
         char        name[20], copyright[64];
         i64         checksum;
@@ -63,10 +65,25 @@ namespace egtb {
             switch (signature) {
                 case EGTB_ID_MAIN_V0:
                     return 0;
+                case EGTB_ID_MAIN_V1:
+                case EGTB_ID_MAIN_V2:
+                    if (blockSizeShift >= EGTB_SIZE_COMPRESS_BLOCK_MIN_SHIFT && blockSizeShift <= EGTB_SIZE_COMPRESS_BLOCK_MAX_SHIFT) {
+                        return signature == EGTB_ID_MAIN_V1 ? 1 : 2;
+                    }
+                    break;
             }
             return -1;
         }
 
+        int getBlockSize() const {
+            return signature == EGTB_ID_MAIN_V0 ? EGTB_SIZE_COMPRESS_BLOCK : 1 << blockSizeShift;
+        }
+
+        // block tables of 64-bit entries
+        bool isWideBlockTable() const {
+            return signature == EGTB_ID_MAIN_V2;
+        }
+
         bool saveFile(std::ofstream& outfile) const {
             outfile.write ((char*)&signature, EGTB_HEADER_SIZE);
             return true;
@@ -106,10 +123,26 @@ namespace egtb {
 
         char*       pBuf[2];
 
-        u32*        compressBlockTables[2];
-        char*       pCompressBuf;
+        EgtbBlockTable compressBlockTables[2];
+
+        // cells loaded in packed mode, pBuf is released then
+        EgtbPackedCells packedCells[2];
+
+        // WDL companion tables (.wdl, 2 bits a cell), loaded into memory with headers if the files exist
+        u8*         pWdl[2];
 
-        EgtbLoadStatus  loadStatus;
+        // opened in tiny mode for reading blocks
+        EgtbFileHandle  fileHandles[2];
+
+        // compressed data (after the block table) loaded in compressed mode
+        char*       pCompressBuf[2];
+
+        // whole files mapped in mapped mode, pBuf or block table (compressed files) points inside them
+        const char* pMap[2];
+        i64         mapSize[2];
+
+        // set after loading, could be read by other threads without locking
+        std::atomic<EgtbLoadStatus> loadStatus;
 
     protected:
         std::string path[2];
@@ -117,11 +150,24 @@ namespace egtb {
         void            reset();
         EgtbLoadMode    loadMode;
 
+        // unique id of the file, used as a part of block cache keys
+        u32             fileId;
+
+        // size of compress blocks (both sides must have the same size) and pages of them in the block cache
+        int             blockSize, pageSize;
+
+        std::string     imageFolder;
+
+        // size, modified time, block count and offset of the block table of files when the catalog was created,
+        // zero if not from a catalog
+        i64             catalogFileSize[2], catalogMtime[2], catalogBlockCnt[2], catalogTableOffset[2];
+
     public:
         i64         startpos[2], endpos[2];
 
         int         idxArr[8];
         i64         idxMult[32];
+        EgtbKeyPlan keyPlan;
         EgtbMemMode memMode;
 
         std::string egtbName;
@@ -132,7 +178,7 @@ namespace egtb {
         std::mutex  sdmtx[2];
 
         EgtbFile();
-        ~EgtbFile();
+        virtual ~EgtbFile();
 
         static bool knownExtension(const std::string& path);
 
@@ -140,8 +186,9 @@ namespace egtb {
 
         i64     getSize() const { return size; }
 
-        int getCompresseBlockCount() const {
-            return (int)((getSize() + EGTB_SIZE_COMPRESS_BLOCK - 1) / EGTB_SIZE_COMPRESS_BLOCK);
+        int getBlockSize() const { return blockSize; }
+        i64 getCompresseBlockCount() const {
+            return (getSize() + blockSize - 1) / blockSize;
         }
         bool    isCompressed() const { return header->property & EGTB_PROP_COMPRESSED; }
 
@@ -151,6 +198,9 @@ namespace egtb {
         void    setPath(const std::string& path, int sd);
         std::string getPath(int sd) const { return path[sd]; }
 
+        // Folder of decompressed images of compressed files (mode all), empty for not using
+        void    setImageFolder(const std::string& folder) { imageFolder = folder; }
+
         std::string getName() const { assert(header == nullptr || egtbName == header->name); return egtbName; }
 
         i64     setupIdxComputing(const std::string& name, int order, int version);
@@ -163,21 +213,14 @@ namespace egtb {
     protected:
         static i64 parseAttr(const int* idxArr, i64* idxMult, int* pieceCount, const int* orderArray, bool enpassantable);
 
-        bool    readBuf(i64 startpos, int sd);
+        bool    readBuf(int sd);
         bool    isDataReady(i64 pos, int sd) const { return pos >= startpos[sd] && pos < endpos[sd] && pBuf[sd]; }
+        bool    isCellReady(i64 pos, int sd) const { return !packedCells[sd].isEmpty() || isDataReady(pos, sd); }
 
-        bool    createBuf(i64 len, int sd);
-
-        i64     getBufItemCnt() const {
-            if (memMode == EgtbMemMode::tiny) {
-                return EGTB_SIZE_COMPRESS_BLOCK;
-            }
-            return getSize();
-        }
+        // modes all and packed load all data of a side
+        bool    isAllDataMode() const { return memMode == EgtbMemMode::all || memMode == EgtbMemMode::packed; }
 
-        i64     getBufSize() const {
-            return getBufItemCnt();
-        }
+        bool    createBuf(i64 len, int sd);
 
         int    pieceCount[2][7];
 
@@ -192,8 +235,24 @@ namespace egtb {
         int     getScore(i64 idx, Side side, bool useLock = true);
         int     getScore(const EgtbBoardCore& board, Side side, bool useLock = true);
 
+        // Win, draw or loss from the WDL table, or from DTM data if the side has no WDL table
+        int     getWdl(i64 idx, Side side);
+        bool    hasWdl(Side side) const { return pWdl[static_cast<int>(side)] != nullptr; }
+        static int scoreToWdl(int score);
+
+        // Derive the WDL table of a side from its DTM data, written next to the DTM file
+        bool    createWdlFile(Side side);
+        std::string getWdlPath(int sd) const;
+
         virtual void    checkToLoadHeaderAndTable();
 
+        // Read the block of idx into the block cache (or memory pages for mapped data) before it is probed
+        void    prefetch(i64 idx, Side side);
+
+        // Same as prefetch but split for reading many blocks at once by an io engine
+        bool    prepareBlockRead(i64 idx, Side side, EgtbIoRequest& request);
+        void    completeBlockRead(i64 idx, Side side, const EgtbIoRequest& request);
+
         bool    setupBoard(EgtbBoardCore& board, i64 idx, FlipMode flip, Side strongsider) const;
 
     protected:
@@ -201,7 +260,7 @@ namespace egtb {
         int     getScoreNoLock(const EgtbBoardCore& board, Side side);
 
     public:
-        bool    preload(const std::string& _path, EgtbMemMode mode, EgtbLoadMode loadMode);
+        bool    preload(const std::string& _path, EgtbMemMode mode, EgtbLoadMode loadMode, const EgtbCatalogRec* catalogRec = nullptr);
         bool    loadHeaderAndTable(const std::string& path);
         virtual void    merge(EgtbFile& otherEgtbFile);
 
@@ -212,7 +271,21 @@ namespace egtb {
         char    getCell(i64 idx, Side side);
 
         bool    loadAllData(std::ifstream& file, Side side);
-        bool    readCompressedBlock(std::ifstream& file, i64 idx, int sd, char* pDest);
+        void    releaseBuf(int sd);
+        bool    loadWdl(Side side);
+        bool    mapAllData(const std::string& path, Side side);
+        bool    loadCompressedData(std::ifstream& file, Side side);
+
+        std::string getImagePath(int sd) const;
+        bool    mapImage(const EgtbFileHeader& imageHeader, Side side);
+        bool    saveImage(const EgtbFileHeader& imageHeader, Side side) const;
+        bool    getBlockPos(i64 idx, int sd, i64& seekpos, int& dataSz, bool& iscompressed) const;
+        int     decodeBlock(i64 idx, char* pDest, const char* data, int dataSz, bool iscompressed) const;
+        int     readBlock(i64 idx, int sd, char* pDest) const;
+        const char* getBlockData(int sd, i64 seekpos, int dataSz, char* buf) const;
+        bool    getCellPartly(i64 idx, int sd, char& cell);
+        void    addBlockToCache(i64 idx, int sd, const char* data, int sz, bool useThreadCache);
+        u64     getCacheKey(i64 idx, int sd) const;
 
         // May remove
     public:
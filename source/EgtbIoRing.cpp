@@ -0,0 +1,190 @@
+/*
+ This file is part of NhatMinh Egtb, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#include "Egtb.h"
+#include "EgtbIoRing.h"
+
+#ifdef EGTB_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+using namespace egtb;
+
+EgtbIoRing::EgtbIoRing() {
+    ringFd = -1;
+    depth = 0;
+    sqPtr = cqPtr = sqes = cqes = nullptr;
+    sqPtrSz = cqPtrSz = sqesSz = 0;
+    sqHead = sqTail = sqMask = sqArray = nullptr;
+    cqHead = cqTail = cqMask = nullptr;
+
+    setup(EGTB_IO_RING_DEPTH);
+}
+
+EgtbIoRing::~EgtbIoRing() {
+    release();
+}
+
+void EgtbIoRing::read(EgtbIoRequest* requests, int cnt) {
+    if (isRingReady()) {
+        readRing(requests, cnt);
+    } else {
+        readOneByOne(requests, cnt);
+    }
+}
+
+void EgtbIoRing::readOneByOne(EgtbIoRequest* requests, int cnt) {
+    for(int i = 0; i < cnt; i++) {
+        auto& req = requests[i];
+        req.ok = readFileAt(req.handle, req.buf, req.size, req.offset);
+    }
+}
+
+#ifdef EGTB_IO_URING
+
+bool EgtbIoRing::setup(unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        // old kernel or blocked (e.g. by seccomp of containers)
+        return false;
+    }
+
+    sqPtrSz = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqPtrSz = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    sqesSz = params.sq_entries * sizeof(io_uring_sqe);
+
+    sqPtr = mmap(nullptr, sqPtrSz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cqPtr = mmap(nullptr, cqPtrSz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqes = mmap(nullptr, sqesSz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    ringFd = fd;
+    if (sqPtr == MAP_FAILED || cqPtr == MAP_FAILED || sqes == MAP_FAILED) {
+        release();
+        return false;
+    }
+
+    auto sq = (char*)sqPtr, cq = (char*)cqPtr;
+    sqHead = (unsigned*)(sq + params.sq_off.head);
+    sqTail = (unsigned*)(sq + params.sq_off.tail);
+    sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+    sqArray = (unsigned*)(sq + params.sq_off.array);
+    cqHead = (unsigned*)(cq + params.cq_off.head);
+    cqTail = (unsigned*)(cq + params.cq_off.tail);
+    cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+    cqes = cq + params.cq_off.cqes;
+
+    depth = params.sq_entries;
+    return true;
+}
+
+void EgtbIoRing::release() {
+    if (sqPtr && sqPtr != MAP_FAILED) munmap(sqPtr, sqPtrSz);
+    if (cqPtr && cqPtr != MAP_FAILED) munmap(cqPtr, cqPtrSz);
+    if (sqes && sqes != MAP_FAILED) munmap(sqes, sqesSz);
+    sqPtr = cqPtr = sqes = cqes = nullptr;
+
+    if (ringFd >= 0) {
+        close(ringFd);
+        ringFd = -1;
+    }
+}
+
+void EgtbIoRing::readRing(EgtbIoRequest* requests, int cnt) {
+    std::vector<bool> done(cnt, false);
+    int nextIdx = 0, inflight = 0;
+    unsigned pending = 0;   // in the submission queue but not consumed by the kernel yet
+
+    while (nextIdx < cnt || inflight > 0) {
+        // fill the submission queue
+        unsigned tail = *sqTail;
+        while (nextIdx < cnt && inflight < (int)depth) {
+            auto& req = requests[nextIdx];
+            auto idx = tail & *sqMask;
+            auto sqe = (io_uring_sqe*)sqes + idx;
+            memset(sqe, 0, sizeof(io_uring_sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = req.handle;
+            sqe->off = (u64)req.offset;
+            sqe->addr = (u64)(uintptr_t)req.buf;
+            sqe->len = (u32)req.size;
+            sqe->user_data = (u64)nextIdx;
+            sqArray[idx] = idx;
+
+            tail++; pending++; nextIdx++; inflight++;
+        }
+        __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+        int r = (int)syscall(__NR_io_uring_enter, ringFd, pending, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (r >= 0) {
+            pending -= MIN((unsigned)r, pending);
+        } else if (errno != EINTR && errno != EAGAIN) {
+            // broken ring: give it up, read the ones not completed yet by positional reads
+            release();
+            for(int i = 0; i < cnt; i++) {
+                if (!done[i]) {
+                    readOneByOne(requests + i, 1);
+                }
+            }
+            return;
+        }
+
+        // reap completions
+        unsigned head = *cqHead;
+        while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+            auto cqe = (io_uring_cqe*)cqes + (head & *cqMask);
+            auto& req = requests[cqe->user_data];
+            if (cqe->res == req.size) {
+                req.ok = true;
+            } else {
+                // short read, interrupted or not supported operation (kernel older than 5.6)
+                req.ok = readFileAt(req.handle, req.buf, req.size, req.offset);
+            }
+            done[cqe->user_data] = true;
+            head++; inflight--;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+}
+
+#else
+
+bool EgtbIoRing::setup(unsigned) {
+    return false;
+}
+
+void EgtbIoRing::release() {
+}
+
+void EgtbIoRing::readRing(EgtbIoRequest* requests, int cnt) {
+    readOneByOne(requests, cnt);
+}
+
+#endif
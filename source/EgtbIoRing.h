@@ -0,0 +1,84 @@
+/*
+ This file is part of NhatMinh Egtb, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#ifndef EgtbIoRing_h
+#define EgtbIoRing_h
+
+#include "Egtb.h"
+
+// io_uring is used on Linux only, define EGTB_NO_IO_URING to always use positional reads
+#if defined(__linux__) && !defined(EGTB_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define EGTB_IO_URING
+#endif
+#endif
+
+#define EGTB_IO_RING_DEPTH          64
+
+namespace egtb {
+
+    class EgtbIoRequest {
+    public:
+        EgtbFileHandle  handle;
+        i64     offset;
+        int     size;
+        char*   buf;
+        bool    ok;
+    };
+
+    /*
+     * Reads many blocks with one system call. On Linux the requests are submitted to
+     * an io_uring queue of EGTB_IO_RING_DEPTH entries, thus the storage gets them all
+     * at once. If the kernel doesn't support io_uring (or on other systems) requests are
+     * read one by one with positional reads.
+     * An object should be used by one thread only.
+     */
+    class EgtbIoRing {
+    public:
+        EgtbIoRing();
+        ~EgtbIoRing();
+
+        bool    isRingReady() const { return ringFd >= 0; }
+
+        void    read(EgtbIoRequest* requests, int cnt);
+
+    private:
+        bool    setup(unsigned entries);
+        void    release();
+
+        void    readOneByOne(EgtbIoRequest* requests, int cnt);
+        void    readRing(EgtbIoRequest* requests, int cnt);
+
+        int     ringFd;
+        unsigned depth;
+
+        void    *sqPtr, *cqPtr, *sqes, *cqes;
+        size_t  sqPtrSz, cqPtrSz, sqesSz;
+        unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+        unsigned *cqHead, *cqTail, *cqMask;
+    };
+
+} // namespace egtb
+
+#endif /* EgtbIoRing_h */
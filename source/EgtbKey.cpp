@@ -33,7 +33,6 @@ namespace egtb {
 using namespace egtb;
 
 extern const int tb_kIdxToPos[10];
-extern int *kk_2, *kk_8;
 
 static const int tb_flipMode[64] = {
     0, 0, 0, 0, 1, 1, 1, 1,
@@ -58,14 +57,105 @@ static const int tb_kIdx[64] = {
     -1,-1,-1,-1, -1,-1,-1,-1
 };
 
-static int* tb_xx, *tb_xxx, *tb_xxxx;
-static int* tb_pp, *tb_ppp, *tb_pppp;
-int *kk_2, *kk_8;
-
 const int tb_kIdxToPos[10] = {
     0, 1, 2, 3, 9, 10, 11, 18, 19, 27
 };
 
+// Same as EgtbBoardCore::flip of squares and of flip modes, as tables for computing keys
+static const int tb_flipSquare[8][64] = {
+    {   // none
+         0,  1,  2,  3,  4,  5,  6,  7,
+         8,  9, 10, 11, 12, 13, 14, 15,
+        16, 17, 18, 19, 20, 21, 22, 23,
+        24, 25, 26, 27, 28, 29, 30, 31,
+        32, 33, 34, 35, 36, 37, 38, 39,
+        40, 41, 42, 43, 44, 45, 46, 47,
+        48, 49, 50, 51, 52, 53, 54, 55,
+        56, 57, 58, 59, 60, 61, 62, 63
+    },
+    {   // horizontal
+         7,  6,  5,  4,  3,  2,  1,  0,
+        15, 14, 13, 12, 11, 10,  9,  8,
+        23, 22, 21, 20, 19, 18, 17, 16,
+        31, 30, 29, 28, 27, 26, 25, 24,
+        39, 38, 37, 36, 35, 34, 33, 32,
+        47, 46, 45, 44, 43, 42, 41, 40,
+        55, 54, 53, 52, 51, 50, 49, 48,
+        63, 62, 61, 60, 59, 58, 57, 56
+    },
+    {   // vertical
+        56, 57, 58, 59, 60, 61, 62, 63,
+        48, 49, 50, 51, 52, 53, 54, 55,
+        40, 41, 42, 43, 44, 45, 46, 47,
+        32, 33, 34, 35, 36, 37, 38, 39,
+        24, 25, 26, 27, 28, 29, 30, 31,
+        16, 17, 18, 19, 20, 21, 22, 23,
+         8,  9, 10, 11, 12, 13, 14, 15,
+         0,  1,  2,  3,  4,  5,  6,  7
+    },
+    {   // flipVH
+         0,  8, 16, 24, 32, 40, 48, 56,
+         1,  9, 17, 25, 33, 41, 49, 57,
+         2, 10, 18, 26, 34, 42, 50, 58,
+         3, 11, 19, 27, 35, 43, 51, 59,
+         4, 12, 20, 28, 36, 44, 52, 60,
+         5, 13, 21, 29, 37, 45, 53, 61,
+         6, 14, 22, 30, 38, 46, 54, 62,
+         7, 15, 23, 31, 39, 47, 55, 63
+    },
+    {   // flipHV
+        63, 55, 47, 39, 31, 23, 15,  7,
+        62, 54, 46, 38, 30, 22, 14,  6,
+        61, 53, 45, 37, 29, 21, 13,  5,
+        60, 52, 44, 36, 28, 20, 12,  4,
+        59, 51, 43, 35, 27, 19, 11,  3,
+        58, 50, 42, 34, 26, 18, 10,  2,
+        57, 49, 41, 33, 25, 17,  9,  1,
+        56, 48, 40, 32, 24, 16,  8,  0
+    },
+    {   // rotate90
+         7, 15, 23, 31, 39, 47, 55, 63,
+         6, 14, 22, 30, 38, 46, 54, 62,
+         5, 13, 21, 29, 37, 45, 53, 61,
+         4, 12, 20, 28, 36, 44, 52, 60,
+         3, 11, 19, 27, 35, 43, 51, 59,
+         2, 10, 18, 26, 34, 42, 50, 58,
+         1,  9, 17, 25, 33, 41, 49, 57,
+         0,  8, 16, 24, 32, 40, 48, 56
+    },
+    {   // rotate180
+        63, 62, 61, 60, 59, 58, 57, 56,
+        55, 54, 53, 52, 51, 50, 49, 48,
+        47, 46, 45, 44, 43, 42, 41, 40,
+        39, 38, 37, 36, 35, 34, 33, 32,
+        31, 30, 29, 28, 27, 26, 25, 24,
+        23, 22, 21, 20, 19, 18, 17, 16,
+        15, 14, 13, 12, 11, 10,  9,  8,
+         7,  6,  5,  4,  3,  2,  1,  0
+    },
+    {   // rotate270
+        56, 48, 40, 32, 24, 16,  8,  0,
+        57, 49, 41, 33, 25, 17,  9,  1,
+        58, 50, 42, 34, 26, 18, 10,  2,
+        59, 51, 43, 35, 27, 19, 11,  3,
+        60, 52, 44, 36, 28, 20, 12,  4,
+        61, 53, 45, 37, 29, 21, 13,  5,
+        62, 54, 46, 38, 30, 22, 14,  6,
+        63, 55, 47, 39, 31, 23, 15,  7
+    }
+};
+
+static const int tb_flipFlip[8][8] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7 },
+    { 1, 0, 6, 7, 5, 4, 2, 3 },
+    { 2, 6, 0, 5, 7, 3, 1, 4 },
+    { 3, 5, 5, 0, 6, 1, 4, 2 },
+    { 4, 7, 7, 6, 0, 2, 3, 1 },
+    { 5, 4, 3, 2, 1, 6, 7, 0 },
+    { 6, 2, 1, 4, 3, 7, 0, 5 },
+    { 7, 3, 4, 1, 2, 0, 5, 6 }
+};
+
 static int bSearch(const int* array, int sz, int key) {
     int i = 0, j = sz - 1;
 
@@ -81,16 +171,123 @@ static int bSearch(const int* array, int sz, int key) {
     return -1;
 }
 
-static void sort_tbkeys(int* tbkeys, int sz) {
-    std::qsort(tbkeys, sz, sizeof(int), [](const void* a, const void* b) {
-        const int* x = static_cast<const int*>(a);
-        const int* y = static_cast<const int*>(b);
-        return (int)(*x - *y);
-    });
+/*
+ * Identical pieces (XX, XXX, XXXX) take sorted squares s0 < s1 < ... of n squares (64, or 48 for pawns
+ * from square 8). Their keys are ranks in the lexicographic order of those squares, computed straight by
+ * binomial coefficients: the reversed squares n - 1 - s0 > n - 1 - s1 > ... have the colex rank
+ * C(n - 1 - s0, k) + C(n - 1 - s1, k - 1) + ..., which counts the combinations after them
+ */
+// C(n, k), n = 0..64, k = 0..4
+static const int tb_binomial[EGTB_SIZE_X + 1][5] = {
+    { 1, 0, 0, 0, 0 },
+    { 1, 1, 0, 0, 0 },
+    { 1, 2, 1, 0, 0 },
+    { 1, 3, 3, 1, 0 },
+    { 1, 4, 6, 4, 1 },
+    { 1, 5, 10, 10, 5 },
+    { 1, 6, 15, 20, 15 },
+    { 1, 7, 21, 35, 35 },
+    { 1, 8, 28, 56, 70 },
+    { 1, 9, 36, 84, 126 },
+    { 1, 10, 45, 120, 210 },
+    { 1, 11, 55, 165, 330 },
+    { 1, 12, 66, 220, 495 },
+    { 1, 13, 78, 286, 715 },
+    { 1, 14, 91, 364, 1001 },
+    { 1, 15, 105, 455, 1365 },
+    { 1, 16, 120, 560, 1820 },
+    { 1, 17, 136, 680, 2380 },
+    { 1, 18, 153, 816, 3060 },
+    { 1, 19, 171, 969, 3876 },
+    { 1, 20, 190, 1140, 4845 },
+    { 1, 21, 210, 1330, 5985 },
+    { 1, 22, 231, 1540, 7315 },
+    { 1, 23, 253, 1771, 8855 },
+    { 1, 24, 276, 2024, 10626 },
+    { 1, 25, 300, 2300, 12650 },
+    { 1, 26, 325, 2600, 14950 },
+    { 1, 27, 351, 2925, 17550 },
+    { 1, 28, 378, 3276, 20475 },
+    { 1, 29, 406, 3654, 23751 },
+    { 1, 30, 435, 4060, 27405 },
+    { 1, 31, 465, 4495, 31465 },
+    { 1, 32, 496, 4960, 35960 },
+    { 1, 33, 528, 5456, 40920 },
+    { 1, 34, 561, 5984, 46376 },
+    { 1, 35, 595, 6545, 52360 },
+    { 1, 36, 630, 7140, 58905 },
+    { 1, 37, 666, 7770, 66045 },
+    { 1, 38, 703, 8436, 73815 },
+    { 1, 39, 741, 9139, 82251 },
+    { 1, 40, 780, 9880, 91390 },
+    { 1, 41, 820, 10660, 101270 },
+    { 1, 42, 861, 11480, 111930 },
+    { 1, 43, 903, 12341, 123410 },
+    { 1, 44, 946, 13244, 135751 },
+    { 1, 45, 990, 14190, 148995 },
+    { 1, 46, 1035, 15180, 163185 },
+    { 1, 47, 1081, 16215, 178365 },
+    { 1, 48, 1128, 17296, 194580 },
+    { 1, 49, 1176, 18424, 211876 },
+    { 1, 50, 1225, 19600, 230300 },
+    { 1, 51, 1275, 20825, 249900 },
+    { 1, 52, 1326, 22100, 270725 },
+    { 1, 53, 1378, 23426, 292825 },
+    { 1, 54, 1431, 24804, 316251 },
+    { 1, 55, 1485, 26235, 341055 },
+    { 1, 56, 1540, 27720, 367290 },
+    { 1, 57, 1596, 29260, 395010 },
+    { 1, 58, 1653, 30856, 424270 },
+    { 1, 59, 1711, 32509, 455126 },
+    { 1, 60, 1770, 34220, 487635 },
+    { 1, 61, 1830, 35990, 521855 },
+    { 1, 62, 1891, 37820, 557845 },
+    { 1, 63, 1953, 39711, 595665 },
+    { 1, 64, 2016, 41664, 635376 }
+};
+
+static inline void sortSquares(int& a, int& b) {
+    if (a > b) std::swap(a, b);
 }
 
-void EgtbKey::createKingKeys() {
-    kk_8 = new int[EGTB_SIZE_KK8];
+// squares must be sorted and different, return -1 if not
+static inline int rankSquares(const int* p, int k, int n) {
+    int colex = 0;
+    for(int i = 0; i < k; i++) {
+        if (p[i] < 0 || p[i] >= n || (i > 0 && p[i] <= p[i - 1])) {
+            return -1;
+        }
+        colex += tb_binomial[n - 1 - p[i]][k - i];
+    }
+    return tb_binomial[n][k] - 1 - colex;
+}
+
+static inline void unrankSquares(int key, int k, int n, int* p) {
+    assert(key >= 0 && key < tb_binomial[n][k]);
+    int colex = tb_binomial[n][k] - 1 - key;
+    for(int i = 0, c = n - 1; i < k; i++, c--) {
+        while (tb_binomial[c][k - i] > colex) {
+            c--;
+        }
+        colex -= tb_binomial[c][k - i];
+        p[i] = n - 1 - c;
+    }
+}
+
+/*
+ * King pairs: squares by keys (k0 << 8 | k1) and keys by squares of the kings (after flipping by the
+ * current flip mode). Entries of the later are key * 8 + the flip mode the pair needs more, keys are -1
+ * for illegal pairs. They are built on the first use, thus processes which never probe don't pay for them
+ */
+class EgtbKingKeys {
+public:
+    EgtbKingKeys();
+
+    int kk8[EGTB_SIZE_KK8], kk2[EGTB_SIZE_KK2];
+    int kk8Key[64][64], kk2Key[64][64];
+};
+
+EgtbKingKeys::EgtbKingKeys() {
     int x = 0;
 
     for(int i = 0; i < sizeof(tb_kIdxToPos) / sizeof(int); i++) {
@@ -101,11 +298,10 @@ void EgtbKey::createKingKeys() {
                 continue;
             }
 
-            kk_8[x++] = k0 << 8 | k1;
+            kk8[x++] = k0 << 8 | k1;
         }
     }
 
-    kk_2 = new int[EGTB_SIZE_KK2];
     x = 0;
 
     for(int k0 = 0; k0 < 64; k0++) {
@@ -120,114 +316,44 @@ void EgtbKey::createKingKeys() {
                 continue;
             }
 
-            kk_2[x++] = k0 << 8 | k1;
+            kk2[x++] = k0 << 8 | k1;
         }
     }
-}
 
-void EgtbKey::createXXKeys() {
-    tb_xx = new int[EGTB_SIZE_XX];
-    tb_xxx = new int[EGTB_SIZE_XXX];
-    tb_xxxx = new int[EGTB_SIZE_XXXX];
+    for(int pos0 = 0; pos0 < 64; pos0++) {
+        for(int pos1 = 0; pos1 < 64; pos1++) {
+            auto flip = static_cast<FlipMode>(tb_flipMode[pos0]);
+            int kk = EgtbBoardCore::flip(pos0, flip) << 8 | EgtbBoardCore::flip(pos1, flip);
+            kk8Key[pos0][pos1] = bSearch(kk8, EGTB_SIZE_KK8, kk) * 8 + static_cast<int>(flip);
 
-    int k0 = 0, k1 = 0, k2 = 0;
-
-    for(int i0 = 0; i0 < 64; i0++) {
-        for(int i1 = i0 + 1; i1 < 64; i1++) {
-            tb_xx[k0++] = i0 << 8 | i1;
-            for(int i2 = i1 + 1; i2 < 64; i2++) {
-                tb_xxx[k1++] = i0 << 16 | i1 << 8 | i2;
-                for(int i3 = i2 + 1; i3 < 64; i3++) {
-                    tb_xxxx[k2++] = i0 << 24 | i1 << 16 | i2 << 8 | i3;
-                }
-            }
+            flip = COL(pos0) > 3 ? FlipMode::horizontal : FlipMode::none;
+            kk = EgtbBoardCore::flip(pos0, flip) << 8 | EgtbBoardCore::flip(pos1, flip);
+            kk2Key[pos0][pos1] = bSearch(kk2, EGTB_SIZE_KK2, kk) * 8 + static_cast<int>(flip);
         }
     }
-
-    // Pawns
-    tb_pp = new int[EGTB_SIZE_PP];
-    tb_ppp = new int[EGTB_SIZE_PPP];
-    tb_pppp = new int[EGTB_SIZE_PPPP];
-
-    k0 = k1 = k2 = 0;
-
-    for(int i0 = 8; i0 < 56; i0++) {
-        for(int i1 = i0 + 1; i1 < 56; i1++) {
-            tb_pp[k0++] = i0 << 8 | i1;
-            for(int i2 = i1 + 1; i2 < 56; i2++) {
-                tb_ppp[k1++] = i0 << 16 | i1 << 8 | i2;
-                for(int i3 = i2 + 1; i3 < 56; i3++) {
-                    tb_pppp[k2++] = i0 << 24 | i1 << 16 | i2 << 8 | i3;
-                }
-            }
-        }
-    }
-}
-
-int EgtbKey::getKey_x(int pos0)
-{
-    return pos0;
 }
 
-int EgtbKey::getKey_xx(int pos0, int pos1)
-{
-    auto p0 = MIN(pos0, pos1);
-    auto p1 = MAX(pos0, pos1);
-
-    int x = p0 << 8 | p1;
-
-    return bSearch(tb_xx, EGTB_SIZE_XX, x);
+// initialization of local statics is thread safe
+static const EgtbKingKeys& getKingKeys() {
+    static const EgtbKingKeys kingKeys;
+    return kingKeys;
 }
 
-int EgtbKey::getKey_xxx(int pos0, int pos1, int pos2)
+int EgtbKey::getKingPair(int key, bool pawn)
 {
-    int p[3] = { pos0, pos1, pos2 };
-    sort_tbkeys(p, 3);
-
-    int x = p[0] << 16 | p[1] << 8 | p[2];
-    return bSearch(tb_xxx, EGTB_SIZE_XXX, x);
+    return pawn ? getKingKeys().kk2[key] : getKingKeys().kk8[key];
 }
 
-int EgtbKey::getKey_xxxx(int pos0, int pos1, int pos2, int pos3)
-{
-    int p[4] = { pos0, pos1, pos2, pos3 };
-    sort_tbkeys(p, 4);
-
-    int x = p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
-    return bSearch(tb_xxxx, EGTB_SIZE_XXXX, x);
-}
-
-
-int EgtbKey::getKey_p(int pos0)
-{
-    assert(pos0 >= 8 && pos0 < 56);
-    return pos0 - 8;
-}
-
-int EgtbKey::getKey_pp(int pos0, int pos1)
-{
-    auto p0 = MIN(pos0, pos1);
-    auto p1 = MAX(pos0, pos1);
-
-    int x = p0 << 8 | p1;
-    return bSearch(tb_pp, EGTB_SIZE_PP, x);
-}
-
-int EgtbKey::getKey_ppp(int pos0, int pos1, int pos2)
-{
-    int p[3] = { pos0, pos1, pos2 };
-    sort_tbkeys(p, 3);
-    int x = p[0] << 16 | p[1] << 8 | p[2];
-    return bSearch(tb_ppp, EGTB_SIZE_PPP, x);
-}
-
-int EgtbKey::getKey_pppp(int pos0, int pos1, int pos2, int pos3)
-{
-    int p[4] = { pos0, pos1, pos2, pos3 };
-    sort_tbkeys(p, 4);
-
-    int x = p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
-    return bSearch(tb_pppp, EGTB_SIZE_PPPP, x);
+// Squares of identical pieces from their key, sorted
+static void getSquares(int key, int k, PieceType type, int* p) {
+    if (type != PieceType::pawn) {
+        unrankSquares(key, k, EGTB_SIZE_X, p);
+        return;
+    }
+    unrankSquares(key, k, EGTB_SIZE_P, p);
+    for(int i = 0; i < k; i++) {
+        p[i] += 8;
+    }
 }
 
 bool EgtbKey::setupBoard_x(EgtbBoardCore& board, int key, PieceType type, Side side) const
@@ -251,16 +377,10 @@ bool EgtbKey::setupBoard_x(EgtbBoardCore& board, int key, PieceType type, Side s
 
 bool EgtbKey::setupBoard_xx(EgtbBoardCore& board, int key, PieceType type, Side side) const
 {
-    int xx;
+    int p[2];
+    getSquares(key, 2, type, p);
 
-    if (type != PieceType::pawn) {
-        xx = tb_xx[key];
-    } else {
-        assert(key < EGTB_SIZE_PP);
-        xx = tb_pp[key];
-    }
-
-    int pos0 = xx >> 8, pos1 = xx & 0xff;
+    int pos0 = p[0], pos1 = p[1];
     auto sd = static_cast<int>(side);
 
     for(int i = 1; i < 16; i++) {
@@ -285,14 +405,10 @@ bool EgtbKey::setupBoard_xx(EgtbBoardCore& board, int key, PieceType type, Side
 
 bool EgtbKey::setupBoard_xxx(EgtbBoardCore& board, int key, PieceType type, Side side) const
 {
-    int xx;
-    if (type != PieceType::pawn) {
-        xx = tb_xxx[key];
-    } else {
-        assert(key >= 0 && key < EGTB_SIZE_PPP);
-        xx = tb_ppp[key];
-    }
-    int pos0 = xx >> 16, pos1 = (xx >> 8) & 0xff, pos2 = xx & 0xff;
+    int p[3];
+    getSquares(key, 3, type, p);
+
+    int pos0 = p[0], pos1 = p[1], pos2 = p[2];
     auto sd = static_cast<int>(side);
 
     for(int i = 1; i < 16; i++) {
@@ -326,15 +442,10 @@ bool EgtbKey::setupBoard_xxx(EgtbBoardCore& board, int key, PieceType type, Side
 
 bool EgtbKey::setupBoard_xxxx(EgtbBoardCore& board, int key, PieceType type, Side side) const
 {
-    int xx;
-    if (type != PieceType::pawn) {
-        xx = tb_xxxx[key];
-    } else {
-        assert(key >= 0 && key < EGTB_SIZE_PPPP);
-        xx = tb_pppp[key];
-    }
+    int p[4];
+    getSquares(key, 4, type, p);
 
-    int pos0 = xx >> 24, pos1 = (xx >> 16) & 0xff, pos2 = (xx >> 8) & 0xff, pos3 = xx & 0xff;
+    int pos0 = p[0], pos1 = p[1], pos2 = p[2], pos3 = p[3];
     auto sd = static_cast<int>(side);
 
     for(int i = 1; i < 16; i++) {
@@ -375,274 +486,212 @@ bool EgtbKey::setupBoard_xxxx(EgtbBoardCore& board, int key, PieceType type, Sid
     return false;
 }
 
-void EgtbKey::initOnce() {
-    createKingKeys();
-    createXXKeys();
+void EgtbKey::getKey(EgtbKeyRec& rec, const EgtbBoardCore& board, const int* idxArr, const i64* idxMult, u32 order) {
+    EgtbKeyPlan plan;
+    plan.init(idxArr, idxMult, order);
+    plan.getKey(rec, board);
 }
 
-EgtbKey::EgtbKey() {
-    initOnce();
+// Sorted key of k identical pieces, squares are from 0 (pawns have been moved down by 8)
+static inline int getKey_identical(int* p, int k, int n) {
+    switch (k) {
+        case 2:
+            sortSquares(p[0], p[1]);
+            break;
+        case 3:
+            sortSquares(p[0], p[1]); sortSquares(p[1], p[2]); sortSquares(p[0], p[1]);
+            break;
+        case 4:
+            sortSquares(p[0], p[1]); sortSquares(p[2], p[3]);
+            sortSquares(p[0], p[2]); sortSquares(p[1], p[3]);
+            sortSquares(p[1], p[2]);
+            break;
+    }
+    return rankSquares(p, k, n);
 }
 
-void EgtbKey::getKey(EgtbKeyRec& rec, const EgtbBoardCore& board, const int* idxArr, const i64* idxMult, u32 order) {
-    int sd = W;
+void EgtbKeyPlan::init(const int* idxArr, const i64* idxMult, u32 order) {
+    if (!order) {
+        order = 0 | 1 << 3 | 2 << 6 | 3 << 9 | 4 << 12 | 5 << 15;
+    }
 
-    // Check which side for left hand side
-    int mat[] = { 0, 0 };
-    int cnt[] = { 0, 0 };
-    int pawnCnt = 0;
+    u32 o[6] = {
+        order & 0x7, (order >> 3) & 0x7, (order >> 6) & 0x7, (order >> 9) & 0x7, (order >> 12) & 0x7, (order >> 15) & 0x7
+    };
 
-    for (int s = 0, d = 0; s < 2; s++, d = 16) {
-        for(int i = 1; i < 16; i++) {
-            if (!board.pieceList[s][i].isEmpty()) {
-                cnt[s]++;
-                int type = static_cast<int>(board.pieceList[s][i].type);
-                mat[s] += exchangePieceValue[type];
-                if (board.pieceList[s][i].type == PieceType::pawn) {
-                    pawnCnt++;
-                }
-            }
+    stepCnt = 0;
+    for(int i = 0; idxArr[i] != EGTB_IDX_NONE; i++) {
+        assert(i < 6);
+        int j = o[i];
+        auto attr = idxArr[j];
+
+        auto& step = steps[stepCnt++];
+        step.attr = attr & 0xff;
+        step.otherSide = (attr >> 8) != W;
+        step.mul = idxMult[j];
+        step.type = 0;
+        step.count = 0;
+
+        if (step.attr >= EGTB_IDX_Q) {
+            int k = (step.attr - EGTB_IDX_Q) / 5;
+            step.type = 1 + step.attr - EGTB_IDX_Q - k * 5;
+            step.count = k + 1;
         }
     }
+}
 
-    auto flipMode = FlipMode::none;
-    if (cnt[B] > cnt[W] || (cnt[B] == cnt[W] && mat[B] > mat[W])) {
-        sd = B;
-        flipMode = FlipMode::vertical;
-    }
+void EgtbKeyPlan::getKey(EgtbKeyRec& rec, const EgtbBoardCore& board) const {
+    EgtbKeyState state;
+    getKey(state, board);
+    rec.key = state.key;
+    rec.flipSide = state.flipSide;
+}
 
-    rec.flipSide = sd == B;
+// key of the identical pieces of a step from their squares (before flipping)
+int EgtbKeyPlan::getSubKey(const Step& step, const int* squares, int flip) const {
+    int base = step.type == static_cast<int>(PieceType::pawn) ? 8 : 0;
 
-    if (!order) {
-        order = 0 | 1 << 3 | 2 << 6 | 3 << 9 | 4 << 12 | 5 << 15;
+    int p[4];
+    for(int k = 0; k < step.count; k++) {
+        p[k] = tb_flipSquare[flip][squares[k]] - base;
+        assert(p[k] >= 0 && p[k] < 64 - base * 2);
     }
 
-    u32 o[6] = {
-        order & 0x7, (order >> 3) & 0x7, (order >> 6) & 0x7, (order >> 9) & 0x7, (order >> 12) & 0x7, (order >> 15) & 0x7
-    };
+    return step.count == 1 ? p[0] : getKey_identical(p, step.count, base ? EGTB_SIZE_P : EGTB_SIZE_X);
+}
 
-    i64 key = 0;
+void EgtbKeyPlan::getKey(EgtbKeyState& state, const EgtbBoardCore& board) const {
+    // squares of pieces by side and type
+    int squares[2][6][4];
+    int cnt[2][6] = { { 0 } };
+    int total[] = { 0, 0 };
 
-    for(int i = 0, stdSd = W; idxArr[i] != EGTB_IDX_NONE; i++) {
-        int j = o[i];
-        auto attr = idxArr[j];
-        auto mul = idxMult[j];
+    for (int s = 0; s < 2; s++) {
+        for(int i = 1; i < 16; i++) {
+            auto& p = board.pieceList[s][i];
+            if (!p.isEmpty()) {
+                int type = static_cast<int>(p.type);
+                squares[s][type][cnt[s][type]++ & 3] = p.idx;
+                total[s]++;
+            }
+        }
+    }
 
-        if (stdSd != (attr >> 8)) {
-            stdSd = (attr >> 8);
-            sd = 1 - sd;
+    // Check which side for left hand side
+    int sd = W;
+    if (total[B] > total[W]) {
+        sd = B;
+    } else if (total[B] == total[W]) {
+        int mat = 0;
+        for(int type = 1; type < 6; type++) {
+            mat += (cnt[B][type] - cnt[W][type]) * exchangePieceValue[type];
+        }
+        if (mat > 0) {
+            sd = B;
         }
+    }
+
+    auto flip = static_cast<int>(sd == B ? FlipMode::vertical : FlipMode::none);
+
+    i64 key = 0;
+
+    for(int i = 0; i < stepCnt; i++) {
+        auto& step = steps[i];
+        int s = step.otherSide ? 1 - sd : sd;
+        int subKey;
 
-        attr &= 0xff;
-        switch (attr) {
+        switch (step.attr) {
             case EGTB_IDX_K_8:
             {
-                auto idx = board.pieceList[sd][0].idx;
+                auto idx = board.pieceList[s][0].idx;
+                flip = tb_flipFlip[flip][tb_flipMode[idx]];
+                idx = tb_flipSquare[flip][idx];
 
-                int flip = tb_flipMode[idx];
-                flipMode = EgtbBoardCore::flip(flipMode, static_cast<FlipMode>(flip));
-                idx = EgtbBoardCore::flip(idx, flipMode);
-
-                auto idx2 = tb_kIdx[idx]; assert(idx2 >= 0 && idx2 < 10);
-                key += idx2 * mul;
+                subKey = tb_kIdx[idx]; assert(subKey >= 0 && subKey < 10);
                 break;
             }
 
             case EGTB_IDX_K_2:
             {
-                int pos = board.pieceList[sd][0].idx;
-                pos = EgtbBoardCore::flip(pos, flipMode);
+                int pos = tb_flipSquare[flip][board.pieceList[s][0].idx];
                 auto f = pos & 0x7;
                 if (f > 3) {
-                    flipMode = EgtbBoardCore::flip(flipMode, FlipMode::horizontal);
+                    flip = tb_flipFlip[flip][static_cast<int>(FlipMode::horizontal)];
                     f = 7 - f;
                 }
                 auto r = pos >> 3;
-                int idx = (r << 2) + f;
-                assert(idx >= 0 && idx < 32);
-                key += idx * mul;
+                subKey = (r << 2) + f;
+                assert(subKey >= 0 && subKey < 32);
                 break;
             }
 
             case EGTB_IDX_KK_2:
-            {
-                int pos0 = EgtbBoardCore::flip(board.pieceList[sd][0].idx, flipMode);
-                int pos1 = EgtbBoardCore::flip(board.pieceList[1 - sd][0].idx, flipMode);
-
-                if (COL(pos0) > 3) {
-                    flipMode = EgtbBoardCore::flip(flipMode, FlipMode::horizontal);
-                    pos0 = EgtbBoardCore::flip(pos0, FlipMode::horizontal);
-                    pos1 = EgtbBoardCore::flip(pos1, FlipMode::horizontal);
-                }
-
-                int kk = pos0 << 8 | pos1;
-                int idx = bSearch(kk_2, EGTB_SIZE_KK2, kk);
-                assert(idx >= 0 && idx < EGTB_SIZE_KK2);
-
-                key += idx * mul;
-                break;
-            }
-
             case EGTB_IDX_KK_8:
             {
-                int pos0 = EgtbBoardCore::flip(board.pieceList[sd][0].idx, flipMode);
-                int pos1 = EgtbBoardCore::flip(board.pieceList[1 - sd][0].idx, flipMode);
+                int pos0 = tb_flipSquare[flip][board.pieceList[s][0].idx];
+                int pos1 = tb_flipSquare[flip][board.pieceList[1 - s][0].idx];
 
-                int flip = tb_flipMode[pos0];
+                int kk = step.attr == EGTB_IDX_KK_2 ? getKingKeys().kk2Key[pos0][pos1] : getKingKeys().kk8Key[pos0][pos1];
+                flip = tb_flipFlip[flip][kk & 7];
 
-                if (flip) {
-                    auto flipMode2 = static_cast<FlipMode>(flip);
-                    flipMode = EgtbBoardCore::flip(flipMode, flipMode2);
-                    pos0 = EgtbBoardCore::flip(pos0, flipMode2);
-                    pos1 = EgtbBoardCore::flip(pos1, flipMode2);
-                }
-
-                int kk = pos0 << 8 | pos1;
-                int idx = bSearch(kk_8, EGTB_SIZE_KK8, kk);
-                key += idx * mul;
+                subKey = kk >> 3;
+                assert(subKey >= 0 && subKey < (step.attr == EGTB_IDX_KK_2 ? EGTB_SIZE_KK2 : EGTB_SIZE_KK8));
                 break;
             }
 
             case EGTB_IDX_K:
             {
-                auto idx = EgtbBoardCore::flip(board.pieceList[sd][0].idx, flipMode);
-                key += idx * mul;
+                subKey = tb_flipSquare[flip][board.pieceList[s][0].idx];
                 break;
             }
 
-            case EGTB_IDX_Q:
-            case EGTB_IDX_R:
-            case EGTB_IDX_B:
-            case EGTB_IDX_H:
-            case EGTB_IDX_P:
+            default:
             {
-                PieceType type = static_cast<PieceType>(attr - EGTB_IDX_Q + 1);
-                for(int t = 1; t < 16; t++) {
-                    auto p = board.pieceList[sd][t];
-                    if (!p.isEmpty() && p.type == type) {
-                        auto pos = EgtbBoardCore::flip(p.idx, flipMode);
-                        assert(pos >= 0 && pos < 64);
-
-                        if (attr == EGTB_IDX_P) {
-                            pos = EgtbKey::getKey_p(pos);
-                        } else {
-                            pos = EgtbKey::getKey_x(pos);
-                        }
-                        key += pos * mul;
-                        break;
-                    }
-                }
+                assert(step.count > 0 && cnt[s][step.type] == step.count);
+                subKey = getSubKey(step, squares[s][step.type], flip);
                 break;
             }
+        }
 
-            case EGTB_IDX_QQ:
-            case EGTB_IDX_RR:
-            case EGTB_IDX_BB:
-            case EGTB_IDX_HH:
-            case EGTB_IDX_PP:
-            {
-                PieceType type = static_cast<PieceType>(attr - EGTB_IDX_QQ + 1);
-
-                for(int t = 1; t < 16; t++) {
-                    auto p0 = board.pieceList[sd][t];
-                    if (!p0.isEmpty() && p0.type == type) {
-                        auto idx0 = EgtbBoardCore::flip(p0.idx, flipMode);
-                        for(t++; t < 16; t++) {
-                            auto p1 = board.pieceList[sd ][t];
-                            if (!p1.isEmpty() && p1.type == type) {
-                                auto idx1 = EgtbBoardCore::flip(p1.idx, flipMode);
-
-                                int subKey = type != PieceType::pawn ? EgtbKey::getKey_xx(idx0, idx1) : EgtbKey::getKey_pp(idx0, idx1);
-                                key += subKey * mul;
-                                break;
-                            }
-                        }
-                        break;
-                    }
-                }
-                break;
-            }
+        state.subKeys[i] = subKey;
+        state.flips[i] = flip;
+        key += subKey * step.mul;
+    }
 
-            case EGTB_IDX_QQQ:
-            case EGTB_IDX_RRR:
-            case EGTB_IDX_BBB:
-            case EGTB_IDX_HHH:
-            case EGTB_IDX_PPP:
-            {
-                PieceType type = static_cast<PieceType>(attr - EGTB_IDX_QQQ + 1);
-
-                for(int t = 1; t < 16; t++) {
-                    auto p0 = board.pieceList[sd][t];
-                    if (!p0.isEmpty() && p0.type == type) {
-                        auto idx0 = EgtbBoardCore::flip(p0.idx, flipMode);
-                        for(t++; t < 16; t++) {
-                            auto p1 = board.pieceList[sd][t];
-                            if (!p1.isEmpty() && p1.type == type) {
-                                auto idx1 = EgtbBoardCore::flip(p1.idx, flipMode);
-                                for(t++; t < 16; t++) {
-                                    auto p2 = board.pieceList[sd][t];
-                                    if (!p2.isEmpty() && p2.type == type) {
-                                        auto idx2 = EgtbBoardCore::flip(p2.idx, flipMode);
-
-                                        int subKey = type != PieceType::pawn ? EgtbKey::getKey_xxx(idx0, idx1, idx2) : EgtbKey::getKey_ppp(idx0, idx1, idx2);
-                                        key += subKey * mul;
-                                        break;
-                                    }
-                                }
-                                break;
-                            }
-                        }
-                        break;
-                    }
-                }
-                break;
-            }
+    assert(key >= 0);
+    state.key = key;
+    state.flipSide = sd == B;
+    state.sd = sd;
+}
 
-            case EGTB_IDX_QQQQ:
-            case EGTB_IDX_RRRR:
-            case EGTB_IDX_BBBB:
-            case EGTB_IDX_HHHH:
-            case EGTB_IDX_PPPP:
-            {
-                PieceType type = static_cast<PieceType>(attr - EGTB_IDX_QQQQ + 1);
-
-                for(int t = 1; t < 16; t++) {
-                    auto p0 = board.pieceList[sd][t];
-                    if (!p0.isEmpty() && p0.type == type) {
-                        auto idx0 = EgtbBoardCore::flip(p0.idx, flipMode);
-                        for(t++; t < 16; t++) {
-                            auto p1 = board.pieceList[sd][t];
-                            if (!p1.isEmpty() && p1.type == type) {
-                                auto idx1 = EgtbBoardCore::flip(p1.idx, flipMode);
-                                for(t++; t < 16; t++) {
-                                    auto p2 = board.pieceList[sd][t];
-                                    if (!p2.isEmpty() && p2.type == type) {
-                                        auto idx2 = EgtbBoardCore::flip(p2.idx, flipMode);
-                                        for(t++; t < 16; t++) {
-                                            auto p3 = board.pieceList[sd][t];
-                                            if (!p3.isEmpty() && p3.type == type) {
-                                                auto idx3 = EgtbBoardCore::flip(p3.idx, flipMode);
-
-                                                int subKey = type != PieceType::pawn ? EgtbKey::getKey_xxxx(idx0, idx1, idx2, idx3) : EgtbKey::getKey_pppp(idx0, idx1, idx2, idx3);
-                                                key += subKey * mul;
-                                                break;
-                                            }
-                                        }
-                                        break;
-                                    }
-                                }
-                                break;
-                            }
-                        }
-                        break;
-                    }
-                }
-                break;
+bool EgtbKeyPlan::updateKey(EgtbKeyState& state, const EgtbBoardCore& board, const Hist& hist) const {
+    // flip modes and the strong side are kept only if the kings and the material are
+    auto piece = board.getPiece(hist.move.dest);
+    if (piece.type == PieceType::king || !hist.cap.isEmpty() || hist.move.promote != PieceType::empty) {
+        return false;
+    }
+
+    int sd = static_cast<int>(piece.side);
+    for(int i = 0; i < stepCnt; i++) {
+        auto& step = steps[i];
+        if (step.type != static_cast<int>(piece.type) || (step.otherSide ? 1 - state.sd : state.sd) != sd) {
+            continue;
+        }
+
+        int squares[4], n = 0;
+        for(int t = 1; t < 16 && n < step.count; t++) {
+            if (board.pieceList[sd][t].type == piece.type) {
+                squares[n++] = board.pieceList[sd][t].idx;
             }
         }
-    }
+        if (n != step.count) {
+            return false;
+        }
 
-    assert(key >= 0);
-    rec.key = key;
+        int subKey = getSubKey(step, squares, state.flips[i]);
+        state.key += (subKey - state.subKeys[i]) * step.mul;
+        state.subKeys[i] = subKey;
+        return true;
+    }
+    return false;
 }
-
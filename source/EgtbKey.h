@@ -39,8 +39,6 @@ namespace egtb {
 
     class EgtbKey {
     public:
-        EgtbKey();
-
         static void getKey(EgtbKeyRec& rec, const EgtbBoardCore& board, const int* idxArr, const i64* idxMult, u32 order);
 
         bool setupBoard_x(EgtbBoardCore& board, int key, PieceType type, Side side) const;
@@ -48,24 +46,47 @@ namespace egtb {
         bool setupBoard_xxx(EgtbBoardCore& board, int key, PieceType type, Side side) const;
         bool setupBoard_xxxx(EgtbBoardCore& board, int key, PieceType type, Side side) const;
 
-    private:
-        static int getKey_x(int pos0);
-        static int getKey_xx(int p0, int p1);
-        static int getKey_xxx(int p0, int p1, int p2);
-        static int getKey_xxxx(int p0, int p1, int p2, int p3);
+        // Squares of kings (k0 << 8 | k1) of a king pair key
+        static int getKingPair(int key, bool pawn);
+    };
 
-        static int getKey_p(int p0);
-        static int getKey_pp(int p0, int p1);
-        static int getKey_ppp(int p0, int p1, int p2);
-        static int getKey_pppp(int p0, int p1, int p2, int p3);
+    // Key with the sub keys and flip modes of its steps, thus keys after moves could be updated
+    class EgtbKeyState {
+    public:
+        i64     key;
+        bool    flipSide;
+        int     sd;
+        int     subKeys[8], flips[8];
+    };
 
-        void initOnce();
+    /*
+     * Key computing of a material, made once from its index attributes and order. Probing gathers the
+     * squares of pieces by side and type in one scan of the piece list, then each step takes its
+     * squares directly instead of searching the list again
+     */
+    class EgtbKeyPlan {
+    public:
+        void init(const int* idxArr, const i64* idxMult, u32 order);
+        void getKey(EgtbKeyRec& rec, const EgtbBoardCore& board) const;
+        void getKey(EgtbKeyState& state, const EgtbBoardCore& board) const;
 
-        void createXXKeys();
-        void createKingKeys();
+        // Update the key after the move of hist has been made on the board. Only quiet moves of pieces
+        // other than kings (no captures nor promotions) could be updated, return false for others
+        bool updateKey(EgtbKeyState& state, const EgtbBoardCore& board, const Hist& hist) const;
 
     private:
-
+        class Step {
+        public:
+            int     attr;       // without side
+            int     type, count;
+            bool    otherSide;  // pieces of the side which is not the strong one
+            i64     mul;
+        };
+
+        Step    steps[8];
+        int     stepCnt = 0;
+
+        int     getSubKey(const Step& step, const int* squares, int flip) const;
     };
 
     extern EgtbKey egtbKey;
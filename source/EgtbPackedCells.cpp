@@ -0,0 +1,115 @@
+/*
+ This file is part of NhatMinh Egtb, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#include <atomic>
+
+#include "Egtb.h"
+#include "EgtbPackedCells.h"
+
+using namespace egtb;
+
+EgtbPackedCells::EgtbPackedCells() {
+    data = nullptr;
+    cnt = 0;
+    bits = 8;
+    mask = 0;
+    memset(dict, 0, sizeof(dict));
+}
+
+EgtbPackedCells::~EgtbPackedCells() {
+    reset();
+}
+
+void EgtbPackedCells::reset() {
+    if (data) {
+        free(data);
+        data = nullptr;
+    }
+    cnt = 0;
+    bits = 8;
+}
+
+// Take the data of other, other becomes empty
+void EgtbPackedCells::moveFrom(EgtbPackedCells& other) {
+    reset();
+    data = other.data;
+    cnt = other.cnt;
+    bits = other.bits;
+    mask = other.mask;
+    memcpy(dict, other.dict, sizeof(dict));
+
+    other.data = nullptr;
+    other.reset();
+}
+
+bool EgtbPackedCells::pack(const char* cells, i64 _cnt) {
+    reset();
+
+    bool used[256] = { false };
+    for (i64 i = 0; i < _cnt; i++) {
+        used[(u8)cells[i]] = true;
+    }
+
+    u8 codes[256];
+    int valueCnt = 0;
+    for (int v = 0; v < 256; v++) {
+        if (used[v]) {
+            if (valueCnt == sizeof(dict)) {
+                return false;
+            }
+            dict[valueCnt] = (char)v;
+            codes[v] = (u8)valueCnt++;
+        }
+    }
+
+    int b = 1;
+    while ((1 << b) < valueCnt) {
+        b++;
+    }
+
+    // two more bytes, the 16-bit read of the last cell must stay inside
+    auto sz = (_cnt * b + 7) / 8 + 2;
+    auto p = (u8*)malloc(sz);
+    if (p == nullptr) {
+        return false;
+    }
+    memset(p, 0, sz);
+
+    for (i64 i = 0; i < _cnt; i++) {
+        auto bitpos = (u64)i * b;
+        u16 w;
+        memcpy(&w, p + (bitpos >> 3), sizeof(w));
+        w |= (u16)(codes[(u8)cells[i]] << (bitpos & 7));
+        memcpy(p + (bitpos >> 3), &w, sizeof(w));
+    }
+
+    cnt = _cnt;
+    bits = b;
+    mask = (u16)((1 << b) - 1);
+
+    // set last, the cells are not empty for readers only when all is ready
+    std::atomic_thread_fence(std::memory_order_release);
+    data = p;
+    return true;
+}
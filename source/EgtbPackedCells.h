@@ -0,0 +1,69 @@
+/*
+ This file is part of NhatMinh Egtb, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#ifndef EgtbPackedCells_h
+#define EgtbPackedCells_h
+
+#include "Egtb.h"
+
+namespace egtb {
+
+    /*
+     * Cells of a side kept in memory with fewer bits (memory mode packed). Distinct cell values
+     * of the side are put in a dictionary, cells keep their indexes in it by as many bits as needed
+     * (1 to 7). A cell never spans more than two bytes, thus it is extracted by a 16-bit read,
+     * a shift and a mask, without any branch.
+     */
+    class EgtbPackedCells {
+    public:
+        EgtbPackedCells();
+        ~EgtbPackedCells();
+
+        // Return false if cells need all 8 bits, nothing is kept then
+        bool    pack(const char* cells, i64 cnt);
+        void    reset();
+        void    moveFrom(EgtbPackedCells& other);
+
+        bool    isEmpty() const { return data == nullptr; }
+        int     getBits() const { return bits; }
+        i64     getMemSize() const { return isEmpty() ? 0 : (cnt * bits + 7) / 8 + 2; }
+
+        char    getCell(i64 idx) const {
+            auto bitpos = (u64)idx * bits;
+            u16 w;
+            memcpy(&w, data + (bitpos >> 3), sizeof(w));
+            return dict[(w >> (bitpos & 7)) & mask];
+        }
+
+    private:
+        u8*     data;
+        i64     cnt;
+        int     bits;
+        u16     mask;
+        char    dict[128];
+    };
+
+} // namespace egtb
+
+#endif /* EgtbPackedCells_h */
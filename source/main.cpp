@@ -37,9 +37,35 @@ egtb::EgtbDb egtbDb;
 // Utility function
 std::string explainScore(int score);
 
-int main() {
+int main(int argc, char* argv[]) {
     std::cout << "Welcome to NhatMinh Chess Endgame databases - version: " << egtb::getVersion() << std::endl;
 
+    /*
+     * Create the catalog of a folder: egtb -catalog <folder>
+     * Later preloadings of that folder read the catalog instead of scanning it and opening all files
+     */
+    if (argc == 3 && std::string(argv[1]) == "-catalog") {
+        if (!egtb::EgtbDb::createCatalog(argv[2])) {
+            std::cerr << "Error: cannot create the catalog for folder " << argv[2] << std::endl;
+            return -1;
+        }
+        std::cout << "Created the catalog for folder " << argv[2] << std::endl;
+        return 0;
+    }
+
+    /*
+     * Create WDL tables of all endgames of a folder: egtb -wdl <folder>
+     * They are small and kept in memory, egtbDb.getWdl probes them
+     */
+    if (argc == 3 && std::string(argv[1]) == "-wdl") {
+        if (!egtb::EgtbDb::createWdlFiles(argv[2])) {
+            std::cerr << "Error: cannot create WDL tables for folder " << argv[2] << std::endl;
+            return -1;
+        }
+        std::cout << "Created WDL tables for folder " << argv[2] << std::endl;
+        return 0;
+    }
+
     /*
      * Allow Egtb to print out more information
      */
@@ -0,0 +1,90 @@
+/*
+ This file is part of NhatMinh Egtb, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+/*
+ * Block cache test: two blocks of a compressed endgame are probed in turn. The first miss of a block
+ * decodes it only up to the cell, the second one makes the whole block cached, all later probes are hits.
+ * Built with cache and decompress stats by: bash build.sh test
+ */
+
+#include <iostream>
+
+#include "Egtb.h"
+
+using namespace egtb;
+
+int main(int argc, char* argv[]) {
+    std::string folder = argc > 1 ? argv[1] : "./egtb";
+
+    EgtbDb egtbDb, allDb;
+    egtbDb.preload(folder, EgtbMemMode::tiny, EgtbLoadMode::loadnow);
+    allDb.preload(folder, EgtbMemMode::all, EgtbLoadMode::loadnow);
+
+    // a compressed endgame having at least two blocks
+    EgtbFile* egtbFile = nullptr;
+    for (auto && f : egtbDb.egtbFileVec) {
+        if (f->isCompressed() && f->header->isSide(Side::white) && f->getSize() >= 2 * (i64)f->getBlockSize()) {
+            egtbFile = f;
+            break;
+        }
+    }
+    if (egtbFile == nullptr) {
+        std::cerr << "Error: no compressed endgame with two blocks in " << folder << std::endl;
+        return 1;
+    }
+    auto allFile = allDb.getEgtbFile(egtbFile->getName());
+
+    // cells in the middle of blocks, thus decoding only up to them doesn't complete blocks
+    auto blockSize = (i64)egtbFile->getBlockSize();
+    i64 idxA = blockSize / 2, idxB = blockSize + blockSize / 2;
+    const int roundCnt = 100;
+
+    egtbBlockCache.resetStats();
+    resetDecompressStats();
+
+    bool ok = true;
+    for(int i = 0; i < roundCnt; i++) {
+        ok = ok && egtbFile->getScore(idxA, Side::white) == allFile->getScore(idxA, Side::white);
+        ok = ok && egtbFile->getScore(idxB, Side::white) == allFile->getScore(idxB, Side::white);
+    }
+    if (!ok) {
+        std::cerr << "Error: scores differ from the ones of memory mode all" << std::endl;
+    }
+
+    // misses: A (decoded partly), B (A given up, B decoded partly), A (read wholly), B (decoded to its end)
+    i64 hits, misses, cnt, nanoseconds;
+    egtbBlockCache.getStats(hits, misses);
+    getDecompressStats(cnt, nanoseconds);
+    if (misses != 4 || hits != 2 * roundCnt - 4) {
+        std::cerr << "Error: cache hits " << hits << ", misses " << misses << ", expected " << 2 * roundCnt - 4 << ", 4" << std::endl;
+        ok = false;
+    }
+    if (cnt != 2) {
+        std::cerr << "Error: blocks decompressed wholly " << cnt << " times, expected 2" << std::endl;
+        ok = false;
+    }
+
+    std::cout << "EgtbCacheTest " << egtbFile->getName() << ": " << (ok ? "passed" : "failed") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,174 @@
+/*
+ This file is part of NhatMinh Egtb, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+/*
+ * Catalog test: a catalog is created in the work copy of the folder, its records are checked against
+ * the endgame files and endgames registered by it are probed. Then it must be found out of date when
+ * a file is rewritten (that file only is rejected) and when a folder or a file is added anywhere.
+ * Modified times have one-second resolution, thus the test waits before changing anything.
+ * Built and run by: bash build.sh test
+ */
+
+#include <iostream>
+#include <fstream>
+#include <thread>
+#include <chrono>
+#include <sys/stat.h>
+
+#include "Egtb.h"
+#include "EgtbCatalog.h"
+
+using namespace egtb;
+
+static void waitForNextSecond() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+}
+
+// Write back the first byte of the file, its size is kept but its modified time changes
+static bool touchFile(const std::string& path) {
+    std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+    char ch;
+    file.read(&ch, 1);
+    file.seekp(0, std::ios::beg);
+    file.write(&ch, 1);
+    file.close();
+    return (bool)file;
+}
+
+static bool checkOutOfDate(const std::string& workFolder, const std::string& what) {
+    EgtbCatalog catalog;
+    if (catalog.load(workFolder)) {
+        std::cerr << "Error: catalog is not out of date after " << what << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    std::string folder = argc > 1 ? argv[1] : "./egtb";
+    std::string workFolder = argc > 2 ? argv[2] : "./work";
+
+    EgtbDb scanDb;
+    scanDb.preload(folder, EgtbMemMode::all, EgtbLoadMode::loadnow);
+
+    // the work copy has just been made, its directory times would not change within the same second
+    waitForNextSecond();
+
+    EgtbCatalog catalog;
+    bool ok = EgtbDb::createCatalog(workFolder) && catalog.load(workFolder);
+    if (!ok) {
+        std::cerr << "Error: cannot create or load the catalog of " << workFolder << std::endl;
+        return 1;
+    }
+
+    // records, one for each side of every file
+    int sideCnt = 0;
+    for (auto && egtbFile : scanDb.egtbFileVec) {
+        for(int sd = 0; sd < 2; sd++) {
+            sideCnt += egtbFile->header->isSide(static_cast<Side>(sd));
+        }
+    }
+    if ((int)catalog.recs.size() != sideCnt) {
+        std::cerr << "Error: catalog has " << catalog.recs.size() << " records, expected " << sideCnt << std::endl;
+        ok = false;
+    }
+
+    for (auto && rec : catalog.recs) {
+        EgtbFileHeader header;
+        memcpy(&header, rec.header, EGTB_HEADER_SIZE);
+        auto egtbFile = scanDb.getEgtbFile(header.name);
+        i64 fileSize, mtime;
+        if (egtbFile == nullptr || !egtbFile->header->isSide(static_cast<Side>(rec.side))
+            || rec.size != egtbFile->getSize() || rec.order != egtbFile->header->order
+            || rec.blockCnt != (egtbFile->isCompressed() ? (u32)egtbFile->getCompresseBlockCount() : 0)
+            || !getFileStat(workFolder + "/" + rec.path, fileSize, mtime) || rec.fileSize != fileSize || rec.mtime != mtime) {
+            std::cerr << "Error: record of " << rec.path << " differs from the file" << std::endl;
+            ok = false;
+        }
+    }
+
+    // endgames registered by the catalog, one file is rewritten after that
+    auto touchedPath = workFolder + "/" + catalog.recs.front().path;
+    waitForNextSecond();
+    if (!touchFile(touchedPath) || !catalog.load(workFolder)) {
+        std::cerr << "Error: catalog is out of date after rewriting a file only" << std::endl;
+        ok = false;
+    }
+
+    EgtbDb catalogDb;
+    catalogDb.preload(workFolder, EgtbMemMode::tiny, EgtbLoadMode::onrequest);
+    if (catalogDb.egtbFileVec.size() != scanDb.egtbFileVec.size()) {
+        std::cerr << "Error: " << catalogDb.egtbFileVec.size() << " endgames registered by the catalog, expected " << scanDb.egtbFileVec.size() << std::endl;
+        ok = false;
+    }
+
+    int rejectedCnt = 0;
+    for (auto && egtbFile : catalogDb.egtbFileVec) {
+        egtbFile->checkToLoadHeaderAndTable();
+        if (egtbFile->loadStatus == EgtbLoadStatus::error) {
+            rejectedCnt++;
+            continue;
+        }
+        auto allFile = scanDb.getEgtbFile(egtbFile->getName());
+        for(int sd = 0; sd < 2 && ok; sd++) {
+            auto side = static_cast<Side>(sd);
+            if (!egtbFile->header->isSide(side)) {
+                continue;
+            }
+            auto step = egtbFile->getSize() / 1000 + 1;
+            for(i64 idx = 0; idx < egtbFile->getSize(); idx += step) {
+                if (egtbFile->getScore(idx, side) != allFile->getScore(idx, side)) {
+                    std::cerr << "Error: " << egtbFile->getName() << ", side " << sd << ", idx " << idx << ", scores differ" << std::endl;
+                    ok = false;
+                    break;
+                }
+            }
+        }
+    }
+    if (rejectedCnt != 1) {
+        std::cerr << "Error: " << rejectedCnt << " endgames rejected, expected the rewritten one only" << std::endl;
+        ok = false;
+    }
+
+    // a new folder, a file in a folder having no endgame and a new subfolder of a folder having some
+    auto emptyFolder = workFolder + "/empty";
+    ok = EgtbDb::createCatalog(workFolder) && ok;
+    waitForNextSecond();
+    mkdir(emptyFolder.c_str(), 0755);
+    ok = checkOutOfDate(workFolder, "adding a folder") && ok;
+
+    ok = EgtbDb::createCatalog(workFolder) && ok;
+    waitForNextSecond();
+    std::ofstream(emptyFolder + "/notes.txt") << "notes" << std::endl;
+    ok = checkOutOfDate(workFolder, "adding a file to a folder having no endgame") && ok;
+
+    auto subFolder = touchedPath.substr(0, touchedPath.find_last_of('/')) + "/sub";
+    ok = EgtbDb::createCatalog(workFolder) && ok;
+    waitForNextSecond();
+    mkdir(subFolder.c_str(), 0755);
+    ok = checkOutOfDate(workFolder, "adding a subfolder") && ok;
+
+    std::cout << "EgtbCatalogTest " << catalog.recs.size() << " records: " << (ok ? "passed" : "failed") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,201 @@
+/*
+ This file is part of NhatMinh Egtb, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+/*
+ * File format test: endgames are written again as V1 files with blocks of 1 KB, stored uncompressed
+ * (flagged in their 32-bit block table entries), or as V2 files (64-bit block tables): blocks of 4 KB, half of
+ * them stored uncompressed (flagged by bit 63), or blocks of 16 KB stored uncompressed. Probing them must give
+ * the scores of the original V0 files in all memory modes. A side of another block size than the one of the
+ * other side must be rejected.
+ *
+ * Run by: bash build.sh test
+ */
+
+#include <fstream>
+#include <iostream>
+
+#include "Egtb.h"
+
+using namespace egtb;
+
+// endgames larger than that are not converted, to keep the test quick
+#define TEST_MAX_SIZE   (3 * 1024 * 1024)
+
+// Write the side of an endgame (loaded in mode all) into outPath with the signature and block size given,
+// as the data of outSide. Blocks at odd indexes keep their compressed data if tinyFile (the endgame loaded
+// in mode tiny, its block size must be the same) is given, other blocks are stored uncompressed
+static bool convertFile(EgtbFile* allFile, EgtbFile* tinyFile, Side side, Side outSide, u16 signature, int blockSizeShift, const std::string& outPath) {
+    auto sd = static_cast<int>(side);
+
+    EgtbFileHeader header;
+    std::ifstream file(allFile->getPath(sd), std::ios::binary);
+    if (!file || !header.readFile(file)) {
+        return false;
+    }
+
+    header.signature = signature;
+    header.blockSizeShift = (u8)blockSizeShift;
+    header.setOnlySide(outSide);
+    header.property |= EGTB_PROP_COMPRESSED;
+
+    auto sz = allFile->getSize();
+    i64 blockSize = (i64)1 << blockSizeShift;
+    auto blockCnt = (sz + blockSize - 1) / blockSize;
+
+    std::vector<char> data;
+    std::vector<u64> ends;
+    for(i64 i = 0; i < blockCnt; i++) {
+        bool iscompressed = false;
+        if (tinyFile && (i & 1)) {
+            auto& blockTable = tinyFile->compressBlockTables[sd];
+            i64 offset, blockSz;
+            blockTable.getBlock(i, offset, blockSz, iscompressed);
+
+            auto k = data.size();
+            data.resize(k + blockSz);
+            file.seekg(EGTB_HEADER_SIZE + blockTable.getTableSize() + offset, std::ios::beg);
+            if (!file.read(data.data() + k, blockSz)) {
+                return false;
+            }
+        } else {
+            auto cells = allFile->pBuf[sd] + i * blockSize;
+            data.insert(data.end(), cells, cells + MIN(blockSize, sz - i * blockSize));
+        }
+
+        u64 end = data.size();
+        if (!iscompressed) {
+            end |= header.isWideBlockTable() ? EGTB_UNCOMPRESS_BIT64 : (u64)(u32)EGTB_UNCOMPRESS_BIT;
+        }
+        ends.push_back(end);
+    }
+
+    std::ofstream outfile(outPath, std::ios::binary | std::ios::trunc);
+    if (!outfile || !header.saveFile(outfile)) {
+        return false;
+    }
+
+    for (auto && end : ends) {
+        if (header.isWideBlockTable()) {
+            outfile.write((const char*)&end, sizeof(end));
+        } else {
+            u32 end32 = (u32)end;
+            outfile.write((const char*)&end32, sizeof(end32));
+        }
+    }
+    outfile.write(data.data(), data.size());
+    return (bool)outfile;
+}
+
+static bool compareScores(EgtbDb& egtbDb, EgtbDb& originDb, const std::vector<std::string>& names, EgtbMemMode memMode) {
+    for (auto && name : names) {
+        auto egtbFile = egtbDb.getEgtbFile(name);
+        auto originFile = originDb.getEgtbFile(name);
+        if (egtbFile) {
+            egtbFile->checkToLoadHeaderAndTable();
+        }
+        if (egtbFile == nullptr || egtbFile->loadStatus != EgtbLoadStatus::loaded) {
+            std::cerr << "Error: not loaded " << name << ", memory mode " << memMode << std::endl;
+            return false;
+        }
+        for(int sd = 0; sd < 2; sd++) {
+            auto side = static_cast<Side>(sd);
+            if (!originFile->header->isSide(side)) {
+                continue;
+            }
+            for(i64 idx = 0; idx < originFile->getSize(); idx++) {
+                if (egtbFile->getScore(idx, side) != originFile->getScore(idx, side)) {
+                    std::cerr << "Error: wrong score " << name << ", idx " << idx << ", memory mode " << memMode << std::endl;
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: EgtbFormatTest <endgame folder> <copy of it to change>" << std::endl;
+        return 1;
+    }
+    std::string folder = argv[1], workFolder = argv[2];
+
+    EgtbDb originDb, tinyDb;
+    originDb.preload(folder, EgtbMemMode::all, EgtbLoadMode::loadnow);
+    tinyDb.preload(folder, EgtbMemMode::tiny, EgtbLoadMode::loadnow);
+
+    // a side with blocks of 1 KB, its twin (named for the other side) with 8 KB
+    EgtbFile* mismatchFile = nullptr;
+    std::vector<std::string> names;
+    bool ok = true;
+    for (auto && allFile : originDb.egtbFileVec) {
+        if (allFile->getSize() > TEST_MAX_SIZE) {
+            continue;
+        }
+
+        auto side = allFile->header->isSide(Side::white) ? Side::white : Side::black;
+        auto path = workFolder + allFile->getPath(static_cast<int>(side)).substr(folder.size());
+        switch (names.size() % 3) {
+            case 0:
+                ok = ok && convertFile(allFile, nullptr, side, side, EGTB_ID_MAIN_V1, 10, path);
+                break;
+            case 1:
+                ok = ok && convertFile(allFile, tinyDb.getEgtbFile(allFile->getName()), side, side, EGTB_ID_MAIN_V2, 12, path);
+                break;
+            default:
+                ok = ok && convertFile(allFile, nullptr, side, side, EGTB_ID_MAIN_V2, 14, path);
+                break;
+        }
+
+        if (mismatchFile == nullptr && side == Side::white) {
+            mismatchFile = allFile;
+            auto pos = path.find_last_of("w");
+            ok = ok && convertFile(allFile, nullptr, side, Side::black, EGTB_ID_MAIN_V1, 13, path.substr(0, pos) + "d" + path.substr(pos + 1));
+            continue;
+        }
+        names.push_back(allFile->getName());
+    }
+    if (!ok || mismatchFile == nullptr) {
+        std::cerr << "Error: cannot convert endgames into " << workFolder << std::endl;
+        return 1;
+    }
+
+    EgtbMemMode memModes[] = { EgtbMemMode::tiny, EgtbMemMode::all, EgtbMemMode::compressed, EgtbMemMode::mapped };
+    for (auto && memMode : memModes) {
+        EgtbDb egtbDb;
+        egtbDb.preload(workFolder, memMode, EgtbLoadMode::onrequest);
+        ok = ok && compareScores(egtbDb, originDb, names, memMode);
+
+        // loading the second side fails, the first one stays in the header
+        auto egtbFile = egtbDb.getEgtbFile(mismatchFile->getName());
+        egtbFile->checkToLoadHeaderAndTable();
+        if (egtbFile->loadStatus != EgtbLoadStatus::error || !egtbFile->header->isSide(Side::black) || egtbFile->header->isSide(Side::white)) {
+            std::cerr << "Error: sides of different block sizes are not rejected " << mismatchFile->getName() << std::endl;
+            ok = false;
+        }
+    }
+
+    std::cout << "EgtbFormatTest " << names.size() << " endgames: " << (ok ? "passed" : "failed") << std::endl;
+    return ok ? 0 : 1;
+}
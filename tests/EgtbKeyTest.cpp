@@ -0,0 +1,126 @@
+/*
+ This file is part of NhatMinh Egtb, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+/*
+ * Incremental key test: boards of every endgame are flipped and have their colours swapped at random, then
+ * for each of their moves the key updated by EgtbKeyPlan::updateKey is compared with a full getKey.
+ * Built and run by: bash build.sh test
+ */
+
+#include <iostream>
+
+#include "Egtb.h"
+
+using namespace egtb;
+
+static u64 nextRandom(u64& rnd) {
+    rnd ^= rnd << 13; rnd ^= rnd >> 7; rnd ^= rnd << 17;
+    return rnd;
+}
+
+// Flip all pieces, swap their colours if needed. Endgames with pawns can be flipped horizontally only
+static bool randomize(EgtbBoard& board, FlipMode flip, bool swapSides) {
+    if (swapSides) {
+        Piece pieces[16];
+        memcpy(pieces, board.pieceList[W], sizeof(pieces));
+        memcpy(board.pieceList[W], board.pieceList[B], sizeof(pieces));
+        memcpy(board.pieceList[B], pieces, sizeof(pieces));
+    }
+    for(int sd = 0; sd < 2; sd++) {
+        for(int i = 0; i < 16; i++) {
+            auto& piece = board.pieceList[sd][i];
+            if (!piece.isEmpty()) {
+                piece.side = static_cast<Side>(sd);
+                piece.idx = EgtbBoardCore::flip(piece.idx, flip);
+                if (swapSides) {
+                    piece.idx = EgtbBoardCore::flip(piece.idx, FlipMode::vertical);
+                }
+            }
+        }
+    }
+    return board.pieceList_setupBoard();
+}
+
+int main(int argc, char* argv[]) {
+    std::string folder = argc > 1 ? argv[1] : "./egtb";
+
+    EgtbDb egtbDb;
+    egtbDb.preload(folder, EgtbMemMode::tiny, EgtbLoadMode::loadnow);
+
+    u64 rnd = 88172645463325252ULL;
+    i64 moveCnt = 0, updatedCnt = 0;
+    bool ok = true;
+    for (auto && egtbFile : egtbDb.egtbFileVec) {
+        auto hasPawns = egtbFile->getName().find('p') != std::string::npos;
+        auto step = egtbFile->getSize() / 500 + 1;
+        for(i64 idx = 0; idx < egtbFile->getSize() && ok; idx += step) {
+            EgtbBoard board;
+            if (!egtbFile->setupBoard(board, idx, FlipMode::none, Side::white)) {
+                continue;
+            }
+            auto r = nextRandom(rnd);
+            auto flip = static_cast<FlipMode>(hasPawns ? r & 1 : r & 7);
+            if (!randomize(board, flip, (r >> 8) & 1) || !board.isValid()) {
+                continue;
+            }
+            board.side = (r >> 9) & 1 ? Side::white : Side::black;
+            if (board.isIncheck(getXSide(board.side))) {
+                continue;
+            }
+
+            auto pEgtbFile = egtbDb.getEgtbFile(board);
+            EgtbKeyState state;
+            pEgtbFile->keyPlan.getKey(state, board);
+
+            MoveList moveList;
+            board.gen(moveList, board.side, false);
+            for(int i = 0; i < moveList.end; i++) {
+                Hist hist;
+                board.make(moveList.list[i], hist);
+                moveCnt++;
+
+                auto updated = state;
+                if (pEgtbFile->keyPlan.updateKey(updated, board, hist)) {
+                    updatedCnt++;
+                    EgtbKeyState full;
+                    pEgtbFile->keyPlan.getKey(full, board);
+                    if (updated.key != full.key || updated.flipSide != full.flipSide) {
+                        std::cerr << "Error: " << pEgtbFile->getName() << ", idx " << idx << ", move " << moveList.list[i].toString()
+                                  << ", updated key " << updated.key << ", full key " << full.key << std::endl;
+                        ok = false;
+                    }
+                }
+                board.takeBack(hist);
+            }
+        }
+    }
+
+    if (updatedCnt == 0) {
+        std::cerr << "Error: no key updated" << std::endl;
+        ok = false;
+    }
+
+    std::cout << "EgtbKeyTest " << moveCnt << " moves, " << updatedCnt << " keys updated: " << (ok ? "passed" : "failed") << std::endl;
+    return ok ? 0 : 1;
+}
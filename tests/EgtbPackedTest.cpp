@@ -0,0 +1,113 @@
+/*
+ This file is part of NhatMinh Egtb, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+/*
+ * Packed memory mode test: every cell of every endgame is probed in packed mode and compared with the one
+ * of memory mode all. With onrequest, several threads probe the same endgames at the same time to catch
+ * cells read while they are being packed.
+ * Built and run by: bash build.sh test
+ */
+
+#include <iostream>
+#include <thread>
+#include <atomic>
+
+#include "Egtb.h"
+
+using namespace egtb;
+
+static bool compareAll(EgtbDb& packedDb, EgtbDb& allDb, int threadIdx, int threadCnt) {
+    bool ok = true;
+    for (auto && egtbFile : packedDb.egtbFileVec) {
+        auto allFile = allDb.getEgtbFile(egtbFile->getName());
+        for(int sd = 0; sd < 2 && ok; sd++) {
+            auto side = static_cast<Side>(sd);
+            // headers of onrequest endgames are loaded by the first probes
+            if (!allFile->header->isSide(side)) {
+                continue;
+            }
+            // threads start at different cells, thus the first probes of an endgame come from all of them
+            auto size = egtbFile->getSize();
+            for(i64 i = 0; i < size; i++) {
+                auto idx = (i + size * threadIdx / threadCnt) % size;
+                if (egtbFile->getScore(idx, side) != allFile->getScore(idx, side)) {
+                    std::cerr << "Error: " << egtbFile->getName() << ", side " << sd << ", idx " << idx << ", scores differ" << std::endl;
+                    ok = false;
+                    break;
+                }
+            }
+        }
+    }
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    std::string folder = argc > 1 ? argv[1] : "./egtb";
+
+    EgtbDb allDb;
+    allDb.preload(folder, EgtbMemMode::all, EgtbLoadMode::loadnow);
+
+    bool ok = true;
+    for(int loadMode = 0; loadMode < 2 && ok; loadMode++) {
+        EgtbDb packedDb;
+        packedDb.preload(folder, EgtbMemMode::packed, loadMode == 0 ? EgtbLoadMode::loadnow : EgtbLoadMode::onrequest);
+
+        const int threadCnt = loadMode == 0 ? 1 : 4;
+        std::atomic<int> failedCnt(0);
+        std::vector<std::thread> threads;
+        for(int t = 0; t < threadCnt; t++) {
+            threads.push_back(std::thread([&, t]() {
+                if (!compareAll(packedDb, allDb, t, threadCnt)) {
+                    failedCnt++;
+                }
+            }));
+        }
+        for (auto && th : threads) {
+            th.join();
+        }
+        ok = failedCnt == 0;
+
+        // most endgames need fewer than 8 bits a cell, their buffers are released
+        int packedCnt = 0;
+        for (auto && egtbFile : packedDb.egtbFileVec) {
+            for(int sd = 0; sd < 2; sd++) {
+                if (!egtbFile->packedCells[sd].isEmpty()) {
+                    packedCnt++;
+                    if (egtbFile->pBuf[sd]) {
+                        std::cerr << "Error: " << egtbFile->getName() << " keeps its buffer after packed" << std::endl;
+                        ok = false;
+                    }
+                }
+            }
+        }
+        if (packedCnt == 0) {
+            std::cerr << "Error: no endgame packed" << std::endl;
+            ok = false;
+        }
+        std::cout << "packed sides: " << packedCnt << ", threads: " << threadCnt << std::endl;
+    }
+
+    std::cout << "EgtbPackedTest " << allDb.egtbFileVec.size() << " endgames: " << (ok ? "passed" : "failed") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,114 @@
+/*
+ This file is part of NhatMinh Egtb, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+/*
+ * WDL test: WDL tables are created in the work copy of the folder, then every cell is probed from them
+ * and compared with the one derived from DTM scores of the original folder. Positions of sides without
+ * tables are probed by the database too, from WDL tables one ply ahead.
+ * Built and run by: bash build.sh test
+ */
+
+#include <iostream>
+
+#include "Egtb.h"
+
+using namespace egtb;
+
+int main(int argc, char* argv[]) {
+    std::string folder = argc > 1 ? argv[1] : "./egtb";
+    std::string workFolder = argc > 2 ? argv[2] : "./work";
+
+    if (!EgtbDb::createWdlFiles(workFolder)) {
+        std::cerr << "Error: cannot create WDL files in " << workFolder << std::endl;
+        return 1;
+    }
+
+    EgtbDb wdlDb, dtmDb;
+    wdlDb.preload(workFolder, EgtbMemMode::tiny, EgtbLoadMode::loadnow);
+    dtmDb.preload(folder, EgtbMemMode::all, EgtbLoadMode::loadnow);
+
+    bool ok = true;
+    int wdlCnt = 0;
+    i64 boardCnt = 0;
+    for (auto && egtbFile : wdlDb.egtbFileVec) {
+        auto dtmFile = dtmDb.getEgtbFile(egtbFile->getName());
+        if (dtmFile == nullptr) {
+            std::cerr << "Error: " << egtbFile->getName() << " is not in " << folder << std::endl;
+            ok = false;
+            continue;
+        }
+
+        // cells, from WDL tables
+        for(int sd = 0; sd < 2 && ok; sd++) {
+            auto side = static_cast<Side>(sd);
+            if (!egtbFile->header->isSide(side)) {
+                continue;
+            }
+            if (!egtbFile->hasWdl(side) || dtmFile->hasWdl(side)) {
+                std::cerr << "Error: " << egtbFile->getName() << ", side " << sd << ", WDL table is not loaded" << std::endl;
+                ok = false;
+                break;
+            }
+            wdlCnt++;
+            for(i64 idx = 0; idx < egtbFile->getSize(); idx++) {
+                auto wdl = egtbFile->getWdl(idx, side);
+                if (wdl != EgtbFile::scoreToWdl(dtmFile->getScore(idx, side)) || wdl != dtmFile->getWdl(idx, side)) {
+                    std::cerr << "Error: " << egtbFile->getName() << ", side " << sd << ", idx " << idx << ", WDL differs" << std::endl;
+                    ok = false;
+                    break;
+                }
+            }
+        }
+
+        // boards of both sides to move, one of them is not in the file
+        auto step = egtbFile->getSize() / 2000 + 1;
+        for(i64 idx = 0; idx < egtbFile->getSize() && ok; idx += step) {
+            EgtbBoard board;
+            if (!egtbFile->setupBoard(board, idx, FlipMode::none, Side::white) || !board.isValid()) {
+                continue;
+            }
+            for(int sd = 0; sd < 2; sd++) {
+                board.side = static_cast<Side>(sd);
+                if (board.isIncheck(getXSide(board.side))) {
+                    continue;
+                }
+                boardCnt++;
+                auto wdl = wdlDb.getWdl(board);
+                if (wdl != EgtbFile::scoreToWdl(dtmDb.getScore(board)) || wdl != dtmDb.getWdl(board)) {
+                    std::cerr << "Error: " << egtbFile->getName() << ", idx " << idx << ", side " << sd << ", WDL of board differs" << std::endl;
+                    ok = false;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (wdlCnt == 0) {
+        std::cerr << "Error: no WDL table loaded" << std::endl;
+        ok = false;
+    }
+
+    std::cout << "EgtbWdlTest " << wdlCnt << " tables, " << boardCnt << " boards: " << (ok ? "passed" : "failed") << std::endl;
+    return ok ? 0 : 1;
+}